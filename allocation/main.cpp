@@ -1,21 +1,100 @@
 #include <assert.h>
+#include <string.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+#include <sys/mman.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
 #include <list>
+#include <map>
 #include <iostream>
+#include <mutex>
+#include <random>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 // Machine word.
 using word_t = uintptr_t;
 
 // Machine word alignment
-inline size_t align(size_t x) {
+constexpr size_t align(size_t x) {
     return (x + sizeof(word_t) - 1) & ~(sizeof(word_t) - 1);
 }
 
+struct Block;
+
+/**
+ * Compressed links (`ALLOC_COMPRESSED_LINKS`): `Block::next` is a 32-bit
+ * offset in words from `linkBase` (0 is null), which covers a 32 GiB
+ * reservation, instead of a full pointer. The header shrinks from 24
+ * to 16 bytes. All the memory then comes from the reservation: its
+ * lower half grows like the program break (see `requestFromOS`), and
+ * the upper half has the chunks and the real-time reserve (see
+ * `mapMemory`).
+ */
+#ifdef ALLOC_COMPRESSED_LINKS
+static const size_t kLinkHeapSize = 32ull << 30;
+static char *linkBase = nullptr;
+static char *linkBreak = nullptr;  // Top of the lower half
+static char *linkMapped = nullptr; // Top of the upper half
+
+class Link {
+public:
+    Link(Block *block = nullptr)
+            : offset(block == nullptr ? 0 : ((char *)block - linkBase) / sizeof(word_t) + 1) {}
+
+    operator Block *() const {
+        return offset == 0 ? nullptr : (Block *)(linkBase + (offset - 1) * sizeof(word_t));
+    }
+
+    Block *operator->() const { return *this; }
+
+private:
+    uint32_t offset;
+};
+
+void reserveLinkHeap() {
+    if (linkBase != nullptr) {
+        return;
+    }
+    auto base = mmap(nullptr, kLinkHeapSize, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    assert(base != MAP_FAILED);
+    linkBase = linkBreak = (char *)base;
+    linkMapped = linkBase + kLinkHeapSize / 2;
+}
+#else
+using Link = Block *;
+#endif
+
+// Expected lifetime of a block (see `alloc`).
+enum class Lifetime : uint8_t {
+    Short,
+    Long,
+};
+
+// Accounting tag of a block, such as a subsystem id (see `alloc`).
+using Tag = uint8_t;
+
 // Allocated block of memory
 struct Block {
     size_t size;
     bool used;
-    Block *next;
+    Lifetime lifetime; // In the padding after `used`
+    Tag tag;           // Also in the padding,
+    uint8_t tagSlot;   // with the slot which counted the allocation
+    Link next;
     word_t data[1]; // payload
 };
 
@@ -25,6 +104,7 @@ enum class SearchMode {
     BestFit,
     FreeList,
     SegregatedList,
+    RealTime, // See `initRealTime`
 };
 
 // Memory manager state
@@ -50,6 +130,93 @@ Block *segregatedTops[] = {
         nullptr,   // 128
 };
 
+/**
+ * Lifetime-segregated placement: short- and long-lived blocks are
+ * carved out of separate chunks, and each lifetime has its own block
+ * list, so a long-lived block doesn't pin a chunk of freed short-lived
+ * ones. The list of a lifetime is swapped into the global state for
+ * the search (as the segregated lists are).
+ */
+struct Region {
+    Block *heapStart;
+    Block *top;
+    Block *searchStart;
+    std::list<Block *> freeList;
+
+    // Unused part of the current chunk:
+    char *cursor;
+    char *end;
+};
+
+static const size_t kChunkSize = 64 * 1024;
+
+/**
+ * Cache colouring: chunks start at the same offset of a page, so their
+ * first (often hottest) blocks would compete for the same cache sets.
+ * Each new chunk starts `kCacheLine` bytes later than the previous one,
+ * rotating through `chunkColours` offsets, taken out of its tail.
+ */
+static const size_t kCacheLine = 64;
+static size_t chunkColours = 16;
+static size_t nextColour = 0;
+
+/**
+ * Real-time mode: blocks come from a reserve which is mapped, faulted
+ * in and locked at `initRealTime`, so allocations never call into the
+ * kernel (and fail when the reserve is used up). Free blocks are kept
+ * in segregated lists of two levels: a power of two, divided into
+ * `kSubclasses` linear classes; bitmaps of the non-empty lists find a
+ * fitting one in O(1). A larger block is split, and its rest goes back
+ * to its list. Blocks are not coalesced.
+ */
+static const int kSubclassBits = 3;
+static const int kSubclasses = 1 << kSubclassBits;
+
+static char *reserveStart = nullptr;
+static char *reserveCursor = nullptr;
+static char *reserveEnd = nullptr;
+
+static uint64_t classBitmap = 0;
+static uint8_t subclassBitmaps[64];
+static Block *classLists[64][kSubclasses];
+
+static bool lifetimePlacement = false;
+static Region regions[2];
+static auto currentLifetime = Lifetime::Short;
+
+// Chunks are mapped, not taken with `sbrk`: the sampling below uses
+// `malloc`, which may move the program break meanwhile, so it can't be
+// rolled back on reset. Start and size of each:
+static std::vector<std::pair<char *, size_t>> chunks;
+
+#ifndef ALLOC_COMPRESSED_LINKS
+// The program break after the last `sbrk` of the heap.
+static void *heapBreak = nullptr;
+#endif
+
+/**
+ * Lifetime prediction: every `kLifetimeSampleRate`-th allocation
+ * is timed (in allocations) until it's freed, or until it outlives
+ * `kShortLifetime`, and counted for its call site.
+ */
+static const size_t kLifetimeSampleRate = 16;
+static const size_t kShortLifetime = 4096;
+
+struct SiteStats {
+    size_t shortLived;
+    size_t longLived;
+};
+
+struct Sample {
+    const void *site;
+    size_t allocatedAt;
+};
+
+static std::unordered_map<const void *, SiteStats> siteStats;
+static std::unordered_map<Block *, Sample> samples;
+static std::deque<std::pair<size_t, Block *>> sampleQueue; // By age
+static size_t allocationClock = 0;
+
 /**
  * Returns total allocation size, reserving in addition the space for
  * the Block structure (object header + first data word).
@@ -62,7 +229,58 @@ inline size_t allocSize(size_t size) {
     return sizeof(Block) + size - sizeof(std::declval<Block>().data);
 }
 
+/**
+ * Maps memory for the chunks and the real-time reserve (with extra
+ * `mmap` flags); nullptr if it fails.
+ */
+char *mapMemory(size_t size, int flags) {
+#ifdef ALLOC_COMPRESSED_LINKS
+    reserveLinkHeap();
+    size = (size + getpagesize() - 1) & ~((size_t)getpagesize() - 1);
+    if (linkMapped + size > linkBase + kLinkHeapSize) {
+        return nullptr;
+    }
+    auto start = linkMapped;
+    if (flags != 0 && mmap(start, size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | flags, -1, 0) == MAP_FAILED) {
+        return nullptr;
+    }
+    linkMapped += size;
+    return start;
+#else
+    auto start = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | flags,
+                      -1, 0);
+    return start == MAP_FAILED ? nullptr : (char *)start;
+#endif
+}
+
+void unmapMemory(char *start, size_t size) {
+#ifdef ALLOC_COMPRESSED_LINKS
+    // Back to reserved (and unlocked) memory; `resetHeap` reuses it.
+    size = (size + getpagesize() - 1) & ~((size_t)getpagesize() - 1);
+    mmap(start, size, PROT_READ | PROT_WRITE,
+         MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+#else
+    munmap(start, size);
+#endif
+}
+
+Block *chunkAllocate(size_t size);
+
 Block *requestFromOS(size_t size) {
+    if (lifetimePlacement) {
+        return chunkAllocate(size);
+    }
+
+#ifdef ALLOC_COMPRESSED_LINKS
+    reserveLinkHeap();
+    if (linkBreak + allocSize(size) > linkBase + kLinkHeapSize / 2) {
+        return nullptr;
+    }
+    auto block = (Block *)linkBreak;
+    linkBreak += allocSize(size);
+    return block;
+#else
     // https://stackoverflow.com/questions/2076532/how-does-sbrk-work-in-c
     // TODO: use `malloc` and `free`
     auto block = (Block *)sbrk(0);
@@ -71,7 +289,9 @@ Block *requestFromOS(size_t size) {
     if (sbrk(allocSize(size)) == (void *)-1) {
         return nullptr;
     }
+    heapBreak = sbrk(0);
     return block;
+#endif
 }
 
 
@@ -91,8 +311,9 @@ Block *split(Block *block, size_t size) {
     return block;
 }
 
+// The rest must hold a whole block, or its header would overwrite the next one.
 inline bool canSplit(Block *block, size_t size) {
-    return (int)(allocSize(block->size) - size) >= (int)sizeof(Block);
+    return block->size >= size + sizeof(Block);
 }
 
 // Allocates a block from the list, splitting if needed.
@@ -168,8 +389,8 @@ Block *bestFit(size_t size) {
         // Found a block of a smaller size, than previous best:
         if (best == nullptr || block->size < best->size) {
             best = block;
-            block = block->next;
         }
+        block = block->next;
     }
 
     if (best == nullptr) {
@@ -197,7 +418,7 @@ Block *freeList(size_t size) {
     return nullptr;
 }
 
-inline int getBucket(size_t size) {
+constexpr int getBucket(size_t size) {
     return size / sizeof(word_t) - 1;
 }
 
@@ -217,6 +438,8 @@ Block *segregatedFit(size_t size) {
     return block;
 }
 
+Block *realTimeAllocate(size_t size);
+
 Block *findBlock(size_t size) {
     switch (searchMode) {
         case SearchMode::FirstFit:
@@ -229,6 +452,8 @@ Block *findBlock(size_t size) {
             return freeList(size);
         case SearchMode::SegregatedList:
             return segregatedFit(size);
+        case SearchMode::RealTime:
+            return realTimeAllocate(size);
     }
 }
 
@@ -245,7 +470,14 @@ Block *coalesce(Block *block) {
     return block;
 }
 
-bool canCoalesce(Block *block) { return block->next && !block->next->used; }
+// Blocks of a lifetime list are adjacent only within a chunk.
+inline bool isAdjacent(Block *block) {
+    return (Block *)((char *)block + allocSize(block->size)) == block->next;
+}
+
+bool canCoalesce(Block *block) {
+    return block->next && !block->next->used && (!lifetimePlacement || isAdjacent(block));
+}
 
 
 // Returns object header (from pointer) (for testing)
@@ -255,38 +487,378 @@ Block *getHeader(word_t *data) {
 }
 
 void resetHeap() {
+    for (auto [chunk, size] : chunks) {
+        unmapMemory(chunk, size);
+    }
+    chunks.clear();
+    for (auto &region : regions) {
+        region = Region{};
+    }
+    samples.clear();
+    sampleQueue.clear();
+
+    if (reserveStart != nullptr) {
+        unmapMemory(reserveStart, reserveEnd - reserveStart);
+        reserveStart = reserveCursor = reserveEnd = nullptr;
+    }
+#ifdef ALLOC_COMPRESSED_LINKS
+    if (linkBase != nullptr) {
+        linkMapped = linkBase + kLinkHeapSize / 2;
+    }
+#endif
+    classBitmap = 0;
+    memset(subclassBitmaps, 0, sizeof(subclassBitmaps));
+    memset(classLists, 0, sizeof(classLists));
+
     if (heapStart == nullptr) {
         return;
     }
 
-    // Roll back to the beginning.
-    brk(heapStart);
+    // Roll back to the beginning (unless `malloc` has moved the break
+    // since, and has memory above the heap: that is left as is).
+#ifdef ALLOC_COMPRESSED_LINKS
+    linkBreak = (char *)heapStart;
+#else
+    if (sbrk(0) == heapBreak) {
+        brk(heapStart);
+    }
+#endif
 
     heapStart = nullptr;
     top = nullptr;
     searchStart = nullptr;
 }
 
-void init(SearchMode mode) {
+/**
+ * Lifetime placement doesn't apply to the segregated lists (which
+ * already separate blocks by size), nor to the real-time mode.
+ */
+void init(SearchMode mode, bool segregateLifetimes = false) {
     searchMode = mode;
     resetHeap();
+    lifetimePlacement = segregateLifetimes && mode != SearchMode::SegregatedList &&
+                        mode != SearchMode::RealTime;
+}
+
+// Swaps the block list of the lifetime with the global one (and back).
+void swapRegion(Lifetime lifetime) {
+    auto &region = regions[(int)lifetime];
+    std::swap(heapStart, region.heapStart);
+    std::swap(top, region.top);
+    std::swap(searchStart, region.searchStart);
+    std::swap(free_list, region.freeList);
+    currentLifetime = lifetime;
+}
+
+/**
+ * Carves a block out of the current chunk of the lifetime, starting
+ * a new chunk when it's full. The rest of the full one becomes a free
+ * block at the end of the list.
+ */
+Block *chunkAllocate(size_t size) {
+    auto &region = regions[(int)currentLifetime];
+    auto bytes = allocSize(size);
+
+    if (region.cursor == nullptr || region.cursor + bytes > region.end) {
+        if (region.cursor != nullptr && region.end - region.cursor >= (long)sizeof(Block)) {
+            auto rest = (Block *)region.cursor;
+            rest->size = region.end - region.cursor - allocSize(0);
+            rest->used = false;
+            rest->next = nullptr;
+            top->next = rest;
+            top = rest;
+            if (searchMode == SearchMode::FreeList) {
+                free_list.push_back(rest);
+            }
+        }
+
+        auto colour = nextColour++ % chunkColours * kCacheLine;
+        auto chunkSize = std::max(kChunkSize, colour + bytes);
+        auto chunk = mapMemory(chunkSize, 0);
+        if (chunk == nullptr) {
+            return nullptr;
+        }
+        chunks.emplace_back(chunk, chunkSize);
+        region.cursor = chunk + colour;
+        region.end = chunk + chunkSize;
+    }
+
+    auto block = (Block *)region.cursor;
+    block->next = nullptr;
+    region.cursor += bytes;
+    return block;
+}
+
+Lifetime predictLifetime(const void *site) {
+    auto stats = siteStats.find(site);
+    if (stats != siteStats.end() && stats->second.longLived > stats->second.shortLived) {
+        return Lifetime::Long;
+    }
+    return Lifetime::Short;
+}
+
+// Counts the samples which outlived `kShortLifetime` as long-lived.
+void ageSamples() {
+    while (!sampleQueue.empty() && sampleQueue.front().first + kShortLifetime < allocationClock) {
+        auto [allocatedAt, block] = sampleQueue.front();
+        sampleQueue.pop_front();
+        auto sample = samples.find(block);
+        if (sample != samples.end() && sample->second.allocatedAt == allocatedAt) {
+            siteStats[sample->second.site].longLived++;
+            samples.erase(sample);
+        }
+    }
+}
+
+void sampleAllocation(Block *block, const void *site) {
+    if (++allocationClock % kLifetimeSampleRate != 0) {
+        return;
+    }
+    samples[block] = Sample{site, allocationClock};
+    sampleQueue.emplace_back(allocationClock, block);
+    ageSamples();
+}
+
+void sampleFree(Block *block) {
+    auto sample = samples.find(block);
+    if (sample == samples.end()) {
+        return;
+    }
+    auto lifetime = allocationClock - sample->second.allocatedAt;
+    auto &stats = siteStats[sample->second.site];
+    (lifetime < kShortLifetime ? stats.shortLived : stats.longLived)++;
+    samples.erase(sample);
+}
+
+#ifdef MAP_POPULATE
+static const int kMapPopulate = MAP_POPULATE;
+#else
+static const int kMapPopulate = 0; // `mlock` faults the pages in
+#endif
+
+/**
+ * Switches to the real-time mode, with a reserve of `reserveSize`
+ * bytes. Returns whether the reserve could be locked in memory
+ * (e.g. within `RLIMIT_MEMLOCK`); it's usable either way, if mapped.
+ */
+bool initRealTime(size_t reserveSize) {
+    init(SearchMode::RealTime);
+    auto base = mapMemory(reserveSize, kMapPopulate);
+    if (base == nullptr) {
+        return false;
+    }
+    reserveStart = reserveCursor = base;
+    reserveEnd = reserveStart + reserveSize;
+    return mlock(base, reserveSize) == 0;
+}
+
+// The list of a block size: `msb(size)`, and the next bits.
+constexpr void sizeClass(size_t size, int &sizeClass, int &subclass) {
+    sizeClass = 63 - __builtin_clzll(size);
+    subclass = (size >> (sizeClass - kSubclassBits)) - kSubclasses;
 }
 
-word_t *alloc(size_t size) {
+// The first list whose every block fits `size` (rounding it up to the next list).
+constexpr void fitClass(size_t size, int &sizeClass, int &subclass) {
+    ::sizeClass(size, sizeClass, subclass);
+    ::sizeClass(size + (1ull << (sizeClass - kSubclassBits)) - 1, sizeClass, subclass);
+}
+
+void pushFree(Block *block, int fl, int sl) {
+    block->used = false;
+    block->next = classLists[fl][sl];
+    classLists[fl][sl] = block;
+    classBitmap |= 1ull << fl;
+    subclassBitmaps[fl] |= 1 << sl;
+}
+
+void pushFree(Block *block) {
+    int fl, sl;
+    sizeClass(block->size, fl, sl);
+    pushFree(block, fl, sl);
+}
+
+Block *popFree(int fl, int sl) {
+    auto block = classLists[fl][sl];
+    classLists[fl][sl] = block->next;
+    if (classLists[fl][sl] == nullptr) {
+        subclassBitmaps[fl] &= ~(1 << sl);
+        if (subclassBitmaps[fl] == 0) {
+            classBitmap &= ~(1ull << fl);
+        }
+    }
+    return block;
+}
+
+// Marks a free block used, splitting off the rest (if any) to its list.
+Block *realTimeTake(Block *block, size_t size) {
+    if (block->size - size >= sizeof(Block)) {
+        auto rest = (Block *)((char *)block + allocSize(size));
+        rest->size = block->size - allocSize(size);
+        pushFree(rest);
+        block->size = size;
+    }
+    block->used = true;
+    return block;
+}
+
+/**
+ * Takes a block of at least `size` bytes: from the first non-empty
+ * list whose every block fits, or else from the reserve.
+ */
+Block *realTimeAllocate(size_t size) {
+    int fl, sl;
+    fitClass(size, fl, sl);
+
+    Block *block = nullptr;
+    uint32_t subclasses = subclassBitmaps[fl] & (~0u << sl);
+    if (subclasses != 0) {
+        block = popFree(fl, __builtin_ctz(subclasses));
+    } else if (fl < 63 && (classBitmap & (~0ull << (fl + 1))) != 0) {
+        fl = __builtin_ctzll(classBitmap & (~0ull << (fl + 1)));
+        block = popFree(fl, __builtin_ctz(subclassBitmaps[fl]));
+    } else if (reserveEnd - reserveCursor >= (long)allocSize(size)) {
+        block = (Block *)reserveCursor;
+        block->size = size;
+        reserveCursor += allocSize(size);
+    } else {
+        return nullptr;
+    }
+    return realTimeTake(block, size);
+}
+
+// Walks the reserve in address order.
+void realTimeTraverse(const std::function<void(Block *)> &callback) {
+    auto block = reserveStart;
+    while (block < reserveCursor) {
+        callback((Block *)block);
+        block += allocSize(((Block *)block)->size);
+    }
+}
+
+/**
+ * Per-tag accounting: live bytes, allocation count and peak of the
+ * blocks of each tag. A thread updates the counters of its own slot,
+ * padded to a cache line, and `tagUsage` adds the slots up. Threads
+ * share slots only beyond `kTagSlots`. A block keeps the slot of its
+ * allocation, which is decremented when another thread frees it.
+ *
+ * The peak needs the live bytes of all the slots together, so it's
+ * only sampled: when a slot passes its own high-water mark (rarely,
+ * once the live bytes of a thread level off), the slots are added up
+ * into the shared peak, and again by `tagUsage`. So a peak which no
+ * slot's own high was part of can be missed.
+ */
+static const Tag kUntagged = 0;
+static const size_t kTags = 64;
+static const size_t kTagSlots = 16;
+
+struct TagCounters {
+    std::atomic<long> liveBytes; // Of the blocks allocated in this slot
+    std::atomic<long> highWater; // Of `liveBytes`
+    std::atomic<size_t> allocations;
+};
+
+struct alignas(kCacheLine) TagSlot {
+    TagCounters tags[kTags];
+};
+
+static TagSlot tagSlots[kTagSlots];
+static std::atomic<long> tagPeaks[kTags];
+static std::atomic<size_t> nextTagSlot{0};
+
+struct TagUsage {
+    long liveBytes;
+    size_t allocations;
+    long peak;
+};
+
+uint8_t threadTagSlot() {
+    thread_local uint8_t slot = nextTagSlot++ % kTagSlots;
+    return slot;
+}
+
+// Raises the peak of the tag to the live bytes of all the slots.
+long samplePeak(Tag tag) {
+    long live = 0;
+    for (auto &slot : tagSlots) {
+        live += slot.tags[tag].liveBytes.load(std::memory_order_relaxed);
+    }
+    auto &peak = tagPeaks[tag];
+    auto current = peak.load(std::memory_order_relaxed);
+    while (live > current && !peak.compare_exchange_weak(current, live, std::memory_order_relaxed)) {
+    }
+    return std::max(live, current);
+}
+
+void countAllocation(Tag tag, uint8_t slot, size_t size) {
+    auto &counters = tagSlots[slot].tags[tag];
+    auto live = counters.liveBytes.fetch_add(size, std::memory_order_relaxed) + (long)size;
+    counters.allocations.fetch_add(1, std::memory_order_relaxed);
+    if (live > counters.highWater.load(std::memory_order_relaxed)) {
+        counters.highWater.store(live, std::memory_order_relaxed);
+        samplePeak(tag);
+    }
+}
+
+void countFree(Tag tag, uint8_t slot, size_t size) {
+    tagSlots[slot].tags[tag].liveBytes.fetch_sub(size, std::memory_order_relaxed);
+}
+
+TagUsage tagUsage(Tag tag) {
+    TagUsage usage = {0, 0, samplePeak(tag)};
+    for (auto &slot : tagSlots) {
+        auto &counters = slot.tags[tag];
+        usage.liveBytes += counters.liveBytes.load(std::memory_order_relaxed);
+        usage.allocations += counters.allocations.load(std::memory_order_relaxed);
+    }
+    return usage;
+}
+
+void resetTagUsage() {
+    for (auto &slot : tagSlots) {
+        for (auto &counters : slot.tags) {
+            counters.liveBytes = 0;
+            counters.highWater = 0;
+            counters.allocations = 0;
+        }
+    }
+    for (auto &peak : tagPeaks) {
+        peak = 0;
+    }
+}
+
+word_t *extendHeap(size_t size);
+
+word_t *allocBlock(size_t size) {
     size = align(size);
 
+
     // Traverse the blocks list, searching for a block of
     // the appropriate size
     if (auto block = findBlock(size)) {
+        block->tag = kUntagged;
         return block->data;
     }
 
+    // The real-time reserve is never extended:
+    if (searchMode == SearchMode::RealTime) {
+        return nullptr;
+    }
+
+    return extendHeap(size);
+}
+
+// Takes a new block from the OS, at the end of its list.
+word_t *extendHeap(size_t size) {
     // Request to map more memory from the OS, bumping the program break (brk).
     auto block = requestFromOS(size);
 
-    // Set the size:
+    // Set the size (the memory may be left from a reset heap):
     block->size = size;
     block->used = true;
+    block->tag = kUntagged;
+    block->next = nullptr;
 
     if (searchMode == SearchMode::SegregatedList) {
         auto bucket = getBucket(size);
@@ -313,8 +885,56 @@ word_t *alloc(size_t size) {
     return block->data;
 }
 
-void free(word_t *data) {
+/**
+ * Allocates a block of the expected `lifetime`, placed with the blocks
+ * of the same lifetime (if enabled in `init`).
+ */
+word_t *alloc(size_t size, Lifetime lifetime) {
+    if (!lifetimePlacement) {
+        return allocBlock(size);
+    }
+    swapRegion(lifetime);
+    auto data = allocBlock(size);
+    getHeader(data)->lifetime = lifetime;
+    swapRegion(lifetime);
+    return data;
+}
+
+// Allocates a block, with the lifetime predicted for the call `site`.
+word_t *allocAt(size_t size, const void *site) {
+    if (!lifetimePlacement) {
+        return allocBlock(size);
+    }
+    auto data = alloc(size, predictLifetime(site));
+    sampleAllocation(getHeader(data), site);
+    return data;
+}
+
+__attribute__((noinline)) word_t *alloc(size_t size) {
+    return allocAt(size, __builtin_return_address(0));
+}
+
+/**
+ * Allocates a block accounted to the `tag` (below `kTags`, and not
+ * `kUntagged`), which is kept in the block header until it's freed.
+ */
+__attribute__((noinline)) word_t *alloc(size_t size, Tag tag) {
+    assert(tag != kUntagged && tag < kTags);
+    auto data = allocAt(size, __builtin_return_address(0));
+    if (data != nullptr) {
+        auto block = getHeader(data);
+        block->tag = tag;
+        block->tagSlot = threadTagSlot();
+        countAllocation(tag, block->tagSlot, block->size);
+    }
+    return data;
+}
+
+void freeBlock(word_t *data) {
     auto block = getHeader(data);
+    if (searchMode == SearchMode::RealTime) {
+        return pushFree(block);
+    }
     if (searchMode != SearchMode::SegregatedList && canCoalesce(block)) {
         block = coalesce(block);
     }
@@ -324,6 +944,83 @@ void free(word_t *data) {
     }
 }
 
+void free(word_t *data) {
+    auto block = getHeader(data);
+    if (block->tag != kUntagged) {
+        countFree(block->tag, block->tagSlot, block->size);
+    }
+    if (!lifetimePlacement) {
+        return freeBlock(data);
+    }
+    sampleFree(block);
+    auto lifetime = block->lifetime;
+    swapRegion(lifetime);
+    freeBlock(data);
+    swapRegion(lifetime);
+}
+
+/**
+ * Allocates a block of a compile-time constant size, as in
+ * `alloc<sizeof(Node)>()`: the list of the size is found at compile
+ * time, and taken directly in the real-time and segregated-list
+ * modes. The other modes use `allocAt`, with the caller as the site
+ * (so this isn't inlined).
+ */
+template <size_t N>
+__attribute__((noinline)) word_t *alloc() {
+    static_assert(N > 0, "Empty blocks aren't allocated");
+    constexpr auto size = align(N);
+    Block *block = nullptr;
+
+    if (searchMode == SearchMode::RealTime) {
+        constexpr auto fit = []() {
+            int fl = 0, sl = 0;
+            fitClass(size, fl, sl);
+            return std::make_pair(fl, sl);
+        }();
+        if (subclassBitmaps[fit.first] & (1 << fit.second)) {
+            block = realTimeTake(popFree(fit.first, fit.second), size);
+        } else if ((block = realTimeAllocate(size)) == nullptr) {
+            return nullptr;
+        }
+    } else if (searchMode == SearchMode::SegregatedList &&
+               getBucket(size) < (int)std::size(segregatedLists)) {
+        constexpr auto bucket = getBucket(size);
+        auto originalHeapStart = heapStart;
+        heapStart = segregatedLists[bucket];
+        block = firstFit(size);
+        heapStart = originalHeapStart;
+        if (block == nullptr) {
+            return extendHeap(size);
+        }
+    } else {
+        return allocAt(N, __builtin_return_address(0));
+    }
+
+    block->tag = kUntagged;
+    return block->data;
+}
+
+/**
+ * Frees a block allocated with `alloc<N>()`. In the real-time mode,
+ * a block of exactly the size goes to the list found at compile time.
+ */
+template <size_t N>
+void free(word_t *data) {
+    constexpr auto size = align(N);
+    auto block = getHeader(data);
+    assert(block->size >= size);
+    if (searchMode != SearchMode::RealTime || block->size != size || block->tag != kUntagged) {
+        return free(data);
+    }
+    constexpr auto list = []() {
+        int fl = 0, sl = 0;
+        sizeClass(size, fl, sl);
+        return std::make_pair(fl, sl);
+    }();
+    pushFree(block, list.first, list.second);
+}
+
 void visit(const std::function<void(Block *)> &callback) {
     auto block = heapStart;
     while (block != nullptr) {
@@ -341,10 +1038,24 @@ void segregatedTraverse(const std::function<void(Block *)> &callback) {
     }
 }
 
+void lifetimeTraverse(const std::function<void(Block *)> &callback) {
+    for (auto lifetime : {Lifetime::Short, Lifetime::Long}) {
+        swapRegion(lifetime);
+        visit(callback);
+        swapRegion(lifetime);
+    }
+}
+
 void traverse(const std::function<void(Block *)> &callback) {
     if (searchMode == SearchMode::SegregatedList) {
         return segregatedTraverse(callback);
     }
+    if (lifetimePlacement) {
+        return lifetimeTraverse(callback);
+    }
+    if (searchMode == SearchMode::RealTime) {
+        return realTimeTraverse(callback);
+    }
     visit(callback);
 }
 
@@ -355,7 +1066,706 @@ void printBlocks() {
     std::cout << "\n";
 }
 
+// Number of pages with used blocks.
+size_t usedPages() {
+    std::set<word_t> pages;
+    traverse([&](Block *block) {
+        if (block->used) {
+            pages.insert((word_t)block / 4096);
+        }
+    });
+    return pages.size();
+}
+
+/**
+ * Bursts of short-lived blocks, with a few long-lived ones allocated
+ * among them (with `alloc<16>()`, if `kConstantSize`). Returns the
+ * pages the long-lived blocks keep in use.
+ */
+template <bool kConstantSize = false>
+size_t mixedWorkload() {
+    std::vector<word_t *> burst;
+    for (int phase = 0; phase < 20; phase++) {
+        for (int i = 0; i < 1000; i++) {
+            burst.push_back(kConstantSize ? alloc<16>() : alloc(16));
+            if (i % 100 == 0) {
+                kConstantSize ? alloc<16>() : alloc(16); // Kept
+            }
+        }
+        for (auto data : burst) {
+            free(data);
+        }
+        burst.clear();
+    }
+    return usedPages();
+}
+
+static const size_t kPageSize = 4096;
+
+/**
+ * Spatial occupancy map of the heap, as text. A line for each page
+ * with blocks, in address order: its number (from the first page),
+ * used bytes, and runs of used (`u`, with the headers), free (`f`)
+ * and unused (`-`, outside any block) bytes:
+ *
+ *   page 3 2816 u2048 f768 -1280
+ *
+ * Then the free holes (adjacent free blocks together) by size, in
+ * powers of two: `hole 1024 7` is 7 holes of 1024 to 2047 bytes.
+ */
+void writeOccupancyMap(std::ostream &out) {
+    struct Extent {
+        word_t start, end;
+        bool used;
+    };
+    std::vector<Extent> extents;
+    traverse([&](Block *block) {
+        extents.push_back({(word_t)block, (word_t)block + allocSize(block->size), block->used});
+    });
+    std::sort(extents.begin(), extents.end(),
+              [](const Extent &a, const Extent &b) { return a.start < b.start; });
+
+    std::map<word_t, std::vector<std::pair<char, size_t>>> pages;
+    auto addRun = [&](word_t page, char state, size_t length) {
+        auto &runs = pages[page];
+        if (!runs.empty() && runs.back().first == state) {
+            runs.back().second += length;
+        } else {
+            runs.emplace_back(state, length);
+        }
+    };
+
+    std::map<size_t, size_t> holes;
+    size_t hole = 0;
+    word_t cursor = 0;
+    for (const auto &extent : extents) {
+        if (hole > 0 && (extent.used || extent.start != cursor)) {
+            holes[size_t(1) << (63 - __builtin_clzll(hole))]++;
+            hole = 0;
+        }
+        if (!extent.used) {
+            hole += extent.end - extent.start;
+        }
+
+        // Split into pages:
+        for (auto address = extent.start; address < extent.end;) {
+            auto page = address / kPageSize;
+            auto end = std::min<word_t>(extent.end, (page + 1) * kPageSize);
+            auto unused = std::max<word_t>(cursor, page * kPageSize);
+            if (unused < address) {
+                addRun(page, '-', address - unused);
+            }
+            addRun(page, extent.used ? 'u' : 'f', end - address);
+            address = cursor = end;
+        }
+    }
+    if (hole > 0) {
+        holes[size_t(1) << (63 - __builtin_clzll(hole))]++;
+    }
+
+    for (auto &[page, runs] : pages) {
+        size_t covered = 0, used = 0;
+        for (auto [state, length] : runs) {
+            covered += length;
+            used += state == 'u' ? length : 0;
+        }
+        if (covered < kPageSize) {
+            addRun(page, '-', kPageSize - covered);
+        }
+        out << "page " << page - pages.begin()->first << " " << used;
+        for (auto [state, length] : runs) {
+            out << " " << state << length;
+        }
+        out << "\n";
+    }
+    for (auto [size, count] : holes) {
+        out << "hole " << size << " " << count << "\n";
+    }
+}
+
+/**
+ * Renders an occupancy map (see `writeOccupancyMap`) as an SVG heat
+ * map: a row for each page, with its utilization (blue to red) and
+ * then its runs, 1 pixel for 8 bytes.
+ */
+void renderOccupancyMap(std::istream &map, std::ostream &svg) {
+    const int kRowHeight = 4, kHeatWidth = 16, kRunsWidth = kPageSize / 8;
+    std::vector<std::string> rows;
+    std::string holes;
+    std::string line;
+    while (std::getline(map, line)) {
+        std::istringstream fields(line);
+        std::string kind;
+        fields >> kind;
+        if (kind == "hole") {
+            size_t size, count;
+            fields >> size >> count;
+            holes += " " + std::to_string(count) + " x " + std::to_string(size) + "+";
+            continue;
+        }
+
+        size_t page, used;
+        fields >> page >> used;
+        auto y = rows.size() * kRowHeight;
+        auto heat = (int)(255 * used / kPageSize);
+        std::ostringstream row;
+        row << "<rect x=\"0\" y=\"" << y << "\" width=\"" << kHeatWidth << "\" height=\""
+            << kRowHeight << "\" fill=\"rgb(" << heat << ",0," << 255 - heat << ")\"/>";
+
+        std::string run;
+        size_t x = 0;
+        while (fields >> run) {
+            auto width = std::stoul(run.substr(1)) / 8;
+            auto colour = run[0] == 'u' ? "#d33" : run[0] == 'f' ? "#3b3" : "#ddd";
+            row << "<rect x=\"" << kHeatWidth + 4 + x << "\" y=\"" << y << "\" width=\"" << width
+                << "\" height=\"" << kRowHeight << "\" fill=\"" << colour << "\"/>";
+            x += width;
+        }
+        rows.push_back(row.str());
+    }
+
+    auto height = rows.size() * kRowHeight + 20;
+    svg << "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"" << kHeatWidth + 4 + kRunsWidth
+        << "\" height=\"" << height << "\">\n";
+    for (const auto &row : rows) {
+        svg << row << "\n";
+    }
+    svg << "<text x=\"0\" y=\"" << height - 6 << "\" font-size=\"10\">Holes:" << holes
+        << "</text>\n</svg>\n";
+}
+
+/**
+ * The same fragmenting workload (blocks of random sizes, about half of
+ * them freed, then more allocated) with first-, next- and best-fit,
+ * exported as occupancy maps to compare where the holes accumulate:
+ * `--occupancy <directory>` writes `<mode>.map` and `<mode>.svg`.
+ */
+int exportOccupancyMaps(const std::string &directory) {
+    std::pair<SearchMode, const char *> modes[] = {
+            {SearchMode::FirstFit, "first-fit"},
+            {SearchMode::NextFit, "next-fit"},
+            {SearchMode::BestFit, "best-fit"},
+    };
+    std::vector<word_t *> blocks;
+    blocks.reserve(3000);
+
+    for (auto [mode, name] : modes) {
+        init(mode);
+        blocks.clear();
+        std::mt19937 random(1);
+        for (int i = 0; i < 3000; i++) {
+            blocks.push_back(alloc(16 + random() % 497));
+        }
+        for (auto data : blocks) {
+            if (random() % 2) {
+                free(data);
+            }
+        }
+        for (int i = 0; i < 1500; i++) {
+            alloc(16 + random() % 497);
+        }
+
+        std::ostringstream map;
+        writeOccupancyMap(map);
+        std::ofstream(directory + "/" + name + ".map") << map.str();
+        std::istringstream input(map.str());
+        std::ofstream svg(directory + "/" + name + ".svg");
+        renderOccupancyMap(input, svg);
+        std::cout << name << ": " << usedPages() << " pages in use\n";
+    }
+    init(SearchMode::FirstFit);
+    return 0;
+}
+
+/**
+ * Counts the L1 data cache read misses of this thread, where the
+ * hardware counters are available (`perf_event_open`).
+ */
+struct MissCounter {
+    int fd = -1;
+
+    MissCounter() {
+#ifdef __linux__
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+    }
+
+    ~MissCounter() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    void start() {
+#ifdef __linux__
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    // Misses since `start`, or -1 if not available.
+    long long stop() {
+        long long misses = -1;
+#ifdef __linux__
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(fd, &misses, sizeof(misses)) != sizeof(misses)) {
+                misses = -1;
+            }
+        }
+#endif
+        return misses;
+    }
+};
+
+/**
+ * Chunk colouring: the first block of each of 64 chunks is hot, and
+ * they are visited as a ring of dependent loads. Without colouring
+ * they all map to the same L1 (and a few L2) sets.
+ */
+void benchChunkColouring() {
+    std::cout << "# Chunk colouring\n\n";
+
+    // `malloc` may move the program break too, so it's reserved before:
+    std::vector<word_t *> hot;
+    hot.reserve(64);
+
+    for (auto colours : {1, 16}) {
+        chunkColours = colours;
+        nextColour = 0;
+        init(SearchMode::FirstFit, true);
+        hot.clear();
+
+        // Two blocks fit into a chunk; the first is the hot one.
+        for (int i = 0; i < 64; i++) {
+            hot.push_back(alloc(32000, Lifetime::Long));
+            alloc(32000, Lifetime::Long);
+        }
+        for (size_t i = 0; i < hot.size(); i++) {
+            hot[i][0] = (word_t)hot[(i + 1) % hot.size()];
+        }
+
+        const int kRounds = 100000;
+        MissCounter counter;
+        auto start = std::chrono::steady_clock::now();
+        counter.start();
+        auto p = hot[0];
+        for (int i = 0; i < kRounds * 64; i++) {
+            p = (word_t *)p[0];
+        }
+        auto misses = counter.stop();
+        auto elapsed = std::chrono::duration<double, std::nano>(
+                std::chrono::steady_clock::now() - start).count();
+
+        std::cout << colours << (colours == 1 ? " colour: " : " colours: ")
+                  << elapsed / (kRounds * 64) << " ns per load, L1D misses: ";
+        if (misses < 0) {
+            std::cout << "n/a";
+        } else {
+            std::cout << misses;
+        }
+        std::cout << "\n";
+        assert(p == hot[0]);
+    }
+    chunkColours = 16;
+    init(SearchMode::FirstFit);
+}
+
+/**
+ * Worst-case latency: random allocations and frees of 8 to 256 bytes,
+ * with first-fit (which searches the whole heap and calls `sbrk`),
+ * and in the real-time mode.
+ */
+void benchWorstCase() {
+    std::cout << "\n# Worst-case latency\n\n";
+    const int kOperations = 20000;
+    std::vector<word_t *> live;
+    live.reserve(kOperations);
+
+    for (auto mode : {SearchMode::FirstFit, SearchMode::RealTime}) {
+        if (mode == SearchMode::RealTime) {
+            initRealTime(16 * 1024 * 1024);
+        } else {
+            init(mode);
+        }
+
+        live.clear();
+        double total = 0, worst = 0;
+        srand(1);
+        for (int i = 0; i < kOperations; i++) {
+            auto start = std::chrono::steady_clock::now();
+            if (live.empty() || rand() % 3 != 0) {
+                live.push_back(alloc(8 + rand() % 249));
+            } else {
+                auto index = rand() % live.size();
+                free(live[index]);
+                live[index] = live.back();
+                live.pop_back();
+            }
+            auto elapsed = std::chrono::duration<double, std::nano>(
+                    std::chrono::steady_clock::now() - start).count();
+            total += elapsed;
+            worst = std::max(worst, elapsed);
+        }
+
+        std::cout << (mode == SearchMode::RealTime ? "Real-time" : "First-fit") << ": "
+                  << total / kOperations << " ns average, " << worst << " ns worst\n";
+    }
+    init(SearchMode::FirstFit);
+}
+
+/**
+ * Allocations of a constant size, with the size class found at run
+ * time and at compile time (in the real-time mode).
+ */
+void benchConstantSize() {
+    std::cout << "\n# Constant-size allocation\n\n";
+    struct Node {
+        Node *left, *right;
+        long value;
+    };
+    const int kBatch = 1000, kRounds = 2000;
+    std::vector<word_t *> batch(kBatch);
+
+    for (auto constant : {false, true}) {
+        initRealTime(1024 * 1024);
+        auto start = std::chrono::steady_clock::now();
+        for (int round = 0; round < kRounds; round++) {
+            for (auto &data : batch) {
+                data = constant ? alloc<sizeof(Node)>() : alloc(sizeof(Node));
+            }
+            for (auto data : batch) {
+                constant ? free<sizeof(Node)>(data) : free(data);
+            }
+        }
+        auto elapsed = std::chrono::duration<double, std::nano>(
+                std::chrono::steady_clock::now() - start).count();
+        std::cout << (constant ? "alloc<N>(): " : "alloc(n): ")
+                  << elapsed / (2.0 * kBatch * kRounds) << " ns per operation\n";
+    }
+    init(SearchMode::FirstFit);
+}
+
+/**
+ * First-fit scans over a long list of small used blocks, which fits
+ * into the caches better with compressed links (compare the builds).
+ */
+void benchListScan() {
+    std::cout << "\n# First-fit scan\n\n";
+    init(SearchMode::FirstFit);
+    const int kBlocks = 100000;
+    for (int i = 0; i < kBlocks; i++) {
+        alloc(8);
+    }
+
+    // Each search walks the whole list, and takes a new block at the end:
+    const int kSearches = 100;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kSearches; i++) {
+        alloc(16);
+    }
+    auto elapsed = std::chrono::duration<double, std::nano>(
+            std::chrono::steady_clock::now() - start).count();
+
+    std::cout << kBlocks * allocSize(8) / 1024 << " KiB of blocks, "
+              << elapsed / kSearches / kBlocks << " ns per block\n";
+    init(SearchMode::FirstFit);
+}
+
+/**
+ * Multi-threaded stress benchmarks, after threadtest, larson,
+ * xmalloc-test and mstress, run on 1 to the number of cores threads.
+ * Each allocator under test is a `BenchAllocator`: the baseline is this
+ * allocator (in the real-time mode) behind one global lock, and the
+ * system `malloc` is for reference. A thread-cache or per-CPU design
+ * would be added as another one.
+ */
+struct BenchAllocator {
+    const char *name;
+    void (*setUp)(int threads);
+    void *(*allocate)(size_t size);
+    void (*release)(void *data);
+    size_t (*footprint)(); // Bytes taken from the OS, or 0 if unknown
+};
+
+static std::mutex heapMutex;
+
+// Acquisitions of the `heapMutex`, the ones which had to wait, and
+// the allocations which failed (the reserve is capped).
+static long lockAcquisitions = 0;
+static long contendedLocks = 0;
+static long failedAllocations = 0;
+
+std::unique_lock<std::mutex> lockHeap() {
+    std::unique_lock<std::mutex> lock(heapMutex, std::try_to_lock);
+    auto contended = !lock.owns_lock();
+    if (contended) {
+        lock.lock();
+        contendedLocks++;
+    }
+    lockAcquisitions++;
+    return lock;
+}
+
+size_t residentBytes() {
+    std::ifstream statm("/proc/self/statm");
+    size_t size = 0, resident = 0;
+    statm >> size >> resident;
+    return resident * getpagesize();
+}
+
+// The reserve is populated and locked, so it's capped on many cores.
+static const size_t kReservePerThread = 64 * 1024 * 1024;
+static const size_t kMaxReserve = 512 * 1024 * 1024;
+static size_t residentAtSetUp = 0;
+
+static const BenchAllocator globalLockAllocator = {
+        "Global lock",
+        [](int threads) { initRealTime(std::min(kReservePerThread * threads, kMaxReserve)); },
+        [](size_t size) -> void * {
+            auto lock = lockHeap();
+            auto data = alloc(size);
+            if (data == nullptr) {
+                failedAllocations++;
+            }
+            return data;
+        },
+        [](void *data) {
+            if (data == nullptr) {
+                return;
+            }
+            auto lock = lockHeap();
+            free((word_t *)data);
+        },
+        []() -> size_t { return reserveCursor - reserveStart; },
+};
+
+static const BenchAllocator systemAllocator = {
+        "System malloc",
+        [](int) { residentAtSetUp = residentBytes(); },
+        [](size_t size) { return malloc(size); },
+        [](void *data) { ::free(data); },
+        // The growth of the resident set: unknown when `malloc` reuses
+        // the memory of the previous runs.
+        []() -> size_t {
+            auto resident = residentBytes();
+            return resident > residentAtSetUp ? resident - residentAtSetUp : 0;
+        },
+};
+
+template <typename Body>
+void runThreads(int threads, const Body &body) {
+    std::vector<std::thread> workers;
+    for (int thread = 0; thread < threads; thread++) {
+        workers.emplace_back(body, thread);
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+}
+
+// Each thread allocates and frees its own batches. Returns the operations.
+long threadTest(const BenchAllocator &allocator, int threads) {
+    const int kRounds = 50, kBatch = 2000;
+    runThreads(threads, [&](int) {
+        std::vector<void *> batch(kBatch);
+        for (int round = 0; round < kRounds; round++) {
+            for (auto &data : batch) {
+                data = allocator.allocate(64);
+            }
+            for (auto data : batch) {
+                allocator.release(data);
+            }
+        }
+    });
+    return 2L * kRounds * kBatch * threads;
+}
+
+// Threads replace random blocks of a shared array: most are freed
+// by another thread than the one which allocated them.
+long larson(const BenchAllocator &allocator, int threads) {
+    const int kSlots = 1000, kOperations = 50000;
+    std::vector<std::atomic<void *>> slots(kSlots * threads);
+    runThreads(threads, [&](int thread) {
+        std::mt19937 random(thread);
+        for (int i = 0; i < kOperations; i++) {
+            auto &slot = slots[random() % slots.size()];
+            auto old = slot.exchange(allocator.allocate(8 + random() % 249));
+            if (old != nullptr) {
+                allocator.release(old);
+            }
+        }
+    });
+    for (auto &slot : slots) {
+        if (slot != nullptr) {
+            allocator.release(slot);
+        }
+    }
+    return 2L * kOperations * threads;
+}
+
+// Producers allocate blocks which consumers free. A single thread
+// alternates between producing a batch and consuming it.
+long producerConsumer(const BenchAllocator &allocator, int threads) {
+    const int kItems = 100000, kBatch = 100;
+    if (threads == 1) {
+        std::vector<void *> batch(kBatch);
+        for (int i = 0; i < kItems; i += kBatch) {
+            for (auto &data : batch) {
+                data = allocator.allocate(64);
+            }
+            for (auto data : batch) {
+                allocator.release(data);
+            }
+        }
+        return 2L * kItems;
+    }
+    auto producers = threads / 2;
+    auto consumers = threads - producers;
+
+    std::mutex queueMutex;
+    std::condition_variable ready;
+    std::deque<void *> queue;
+    int producing = producers;
+
+    runThreads(producers + consumers, [&](int thread) {
+        if (thread < producers) {
+            for (int i = 0; i < kItems; i++) {
+                auto data = allocator.allocate(64);
+                std::lock_guard<std::mutex> lock(queueMutex);
+                queue.push_back(data);
+                ready.notify_one();
+            }
+            std::lock_guard<std::mutex> lock(queueMutex);
+            producing--;
+            ready.notify_all();
+            return;
+        }
+        while (true) {
+            std::unique_lock<std::mutex> lock(queueMutex);
+            ready.wait(lock, [&]() { return !queue.empty() || producing == 0; });
+            if (queue.empty()) {
+                return;
+            }
+            auto data = queue.front();
+            queue.pop_front();
+            lock.unlock();
+            allocator.release(data);
+        }
+    });
+    return 2L * kItems * producers;
+}
+
+// Bursts of many blocks of mixed sizes, all freed after each burst.
+long bursty(const BenchAllocator &allocator, int threads) {
+    const int kBursts = 10, kBurst = 20000;
+    runThreads(threads, [&](int thread) {
+        std::mt19937 random(thread);
+        std::vector<void *> burst(kBurst);
+        for (int i = 0; i < kBursts; i++) {
+            for (auto &data : burst) {
+                data = allocator.allocate(16 + random() % 1009);
+            }
+            for (auto data : burst) {
+                allocator.release(data);
+            }
+        }
+    });
+    return 2L * kBursts * kBurst * threads;
+}
+
+void benchThreads() {
+    std::cout << "\n# Multi-threaded stress\n";
+    int cores = std::max(1u, std::thread::hardware_concurrency());
+
+    struct Workload {
+        const char *name;
+        long (*run)(const BenchAllocator &allocator, int threads);
+    };
+    Workload workloads[] = {
+            {"threadtest", threadTest},
+            {"larson", larson},
+            {"producer-consumer", producerConsumer},
+            {"bursty", bursty},
+    };
+
+    for (const auto &workload : workloads) {
+        std::cout << "\n" << workload.name << ":\n";
+        for (auto allocator : {&globalLockAllocator, &systemAllocator}) {
+            double single = 0;
+            for (int threads = 1;; threads = std::min(threads * 2, cores)) {
+                allocator->setUp(threads);
+                lockAcquisitions = contendedLocks = failedAllocations = 0;
+
+                auto start = std::chrono::steady_clock::now();
+                auto operations = workload.run(*allocator, threads);
+                auto elapsed = std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - start).count();
+                auto throughput = operations / elapsed / 1e6;
+                if (threads == 1) {
+                    single = throughput;
+                }
+
+                std::cout << "  " << allocator->name << ", " << threads << " threads: "
+                          << throughput << " Mops/s (x" << throughput / single << "), ";
+                if (lockAcquisitions > 0) {
+                    std::cout << 100.0 * contendedLocks / lockAcquisitions << "% contended, ";
+                }
+                if (auto footprint = allocator->footprint()) {
+                    std::cout << footprint / threads / 1024 << " KiB per thread";
+                } else {
+                    std::cout << "footprint unavailable";
+                }
+                if (failedAllocations > 0) {
+                    std::cout << ", " << failedAllocations << " allocations failed";
+                }
+                std::cout << "\n";
+
+                if (threads == cores) {
+                    break;
+                }
+            }
+        }
+    }
+    init(SearchMode::FirstFit);
+}
+
+/**
+ * Benchmarks: `--bench`.
+ */
+int runBenchmarks() {
+    benchChunkColouring();
+    benchWorstCase();
+    benchListScan();
+    benchConstantSize();
+    benchThreads();
+    return 0;
+}
+
 int main(int argc, char const *argv[]) {
+#ifdef ALLOC_COMPRESSED_LINKS
+    std::cout << "Compressed links, block header = " << allocSize(0) << " bytes\n\n";
+#else
+    std::cout << "Full links, block header = " << allocSize(0) << " bytes\n\n";
+#endif
+
+    if (argc == 2 && strcmp(argv[1], "--bench") == 0) {
+        return runBenchmarks();
+    }
+    if (argc == 3 && strcmp(argv[1], "--occupancy") == 0) {
+        return exportOccupancyMaps(argv[2]);
+    }
+
     // First-fit search
     std::cout << "# First-fit search\n\n";
     init(SearchMode::FirstFit);
@@ -553,6 +1963,141 @@ int main(int argc, char const *argv[]) {
     free(s3);
     printBlocks();
 
+    // Lifetime-segregated placement
+    std::cout << "\n# Lifetime-segregated placement\n\n";
+    init(SearchMode::FirstFit, true);
+
+    // Explicit hints: the blocks are in separate chunks and lists.
+    auto l1 = alloc(16, Lifetime::Long);
+    auto l2 = alloc(16, Lifetime::Short);
+    assert(getHeader(l1)->lifetime == Lifetime::Long);
+    assert(regions[(int)Lifetime::Long].heapStart == getHeader(l1));
+    assert(regions[(int)Lifetime::Short].heapStart == getHeader(l2));
+    printBlocks();
+    free(l1);
+    free(l2);
+
+    // Predicted lifetimes (learned in a first run, and kept across
+    // `init`): the kept blocks share a few pages, instead of pinning
+    // the pages of every burst.
+    init(SearchMode::FirstFit);
+    auto mixedPages = mixedWorkload();
+    init(SearchMode::FirstFit, true);
+    mixedWorkload();
+    init(SearchMode::FirstFit, true);
+    auto segregatedPages = mixedWorkload();
+    std::cout << "Pages in use: " << mixedPages << " mixed, " << segregatedPages
+              << " segregated by lifetime\n";
+    assert(segregatedPages < mixedPages);
+
+    // The same with `alloc<N>()`, whose call sites are told apart too:
+    init(SearchMode::FirstFit, true);
+    mixedWorkload<true>();
+    init(SearchMode::FirstFit, true);
+    assert(mixedWorkload<true>() < mixedPages);
+    init(SearchMode::FirstFit);
+
+    // Real-time mode
+    std::cout << "\n# Real-time mode\n\n";
+    auto locked = initRealTime(1024 * 1024);
+    std::cout << "Reserve " << (locked ? "locked" : "not locked") << "\n";
+    auto programBreak = sbrk(0);
+
+    // [size = 8, used = 1] [size = 64, used = 1]
+    auto r1 = alloc(8);
+    auto r2 = alloc(64);
+    printBlocks();
+
+    // A free block of the size class is reused:
+    free(r1);
+    auto r3 = alloc(3);
+    assert(getHeader(r3) == getHeader(r1));
+
+    // A larger one is split, and the rest is free:
+    // [size = 8, used = 1] [size = 16, used = 1] [size = 24, used = 0]
+    free(r2);
+    auto r4 = alloc(16);
+    assert(getHeader(r4) == getHeader(r2));
+    assert(getHeader(r4)->size == 16);
+    printBlocks();
+
+    // Without calls into the kernel:
+    assert(alloc(2 * 1024 * 1024) == nullptr);
+    assert(sbrk(0) == programBreak);
+    init(SearchMode::FirstFit);
+
+    // Constant-size allocation
+    std::cout << "\n# Constant-size allocation\n\n";
+    initRealTime(1024 * 1024);
+
+    // [size = 24, used = 1] [size = 24, used = 1]
+    auto c1 = alloc<24>();
+    auto c2 = alloc<24>();
+    printBlocks();
+
+    // Taken from the list found at compile time:
+    free<24>(c1);
+    assert(classLists[4][4] == getHeader(c1));
+    auto c3 = alloc<20>();
+    assert(getHeader(c3) == getHeader(c1));
+
+    // A block of a larger list is split, as with `alloc(n)`:
+    // [size = 24, used = 1] [size = 24, used = 1] [size = 16, used = 1] [size = 8, used = 0]
+    auto c4 = alloc<48>();
+    free<48>(c4);
+    auto c5 = alloc<16>();
+    assert(getHeader(c5) == getHeader(c4) && getHeader(c5)->size == 16);
+    printBlocks();
+    free<24>(c2);
+    free<20>(c3);
+    free<16>(c5);
+
+    init(SearchMode::SegregatedList);
+    auto c6 = alloc<16>();
+    assert(getHeader(c6) == segregatedLists[1]);
+    free<16>(c6);
+    assert(alloc<16>() == c6);
+    init(SearchMode::FirstFit);
+
+    // Per-tag accounting
+    std::cout << "\n# Per-tag accounting\n\n";
+    const Tag kParser = 1, kCache = 2;
+    for (auto mode : {SearchMode::FirstFit, SearchMode::SegregatedList, SearchMode::RealTime}) {
+        if (mode == SearchMode::RealTime) {
+            initRealTime(1024 * 1024);
+        } else {
+            init(mode);
+        }
+        resetTagUsage();
+
+        auto t1 = alloc(16, kParser);
+        auto t2 = alloc(32, kParser);
+        auto t3 = alloc(64, kCache);
+        auto t4 = alloc(8);
+        free(t1);
+
+        // Another thread frees blocks of the parser, which are taken off
+        // this thread's slot, and don't add up in the peak:
+        std::thread([&]() { free(t2); }).join();
+        for (int i = 0; i < 10; i++) {
+            auto t5 = alloc(32, kParser);
+            std::thread([&]() { free(t5); }).join();
+        }
+        assert(tagSlots[threadTagSlot()].tags[kParser].liveBytes == 0);
+
+        auto parser = tagUsage(kParser);
+        auto cache = tagUsage(kCache);
+        std::cout << "Parser: " << parser.liveBytes << " bytes live, " << parser.allocations
+                  << " allocations, peak " << parser.peak << "; cache: " << cache.liveBytes
+                  << " bytes live\n";
+        assert(parser.liveBytes == 0 && parser.allocations == 12 && parser.peak == 48);
+        assert(cache.liveBytes == 64 && cache.allocations == 1);
+        assert(getHeader(t4)->tag == kUntagged);
+        free(t3);
+        free(t4);
+    }
+    init(SearchMode::FirstFit);
+
     puts("\nAll assertions passed!\n");
     return 0;
 }
\ No newline at end of file
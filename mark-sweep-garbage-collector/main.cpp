@@ -1,10 +1,29 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <fstream>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <thread>
 
+#include <functional>
 #include <map>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include <cxxabi.h>
+#include <fcntl.h>
 #include <setjmp.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 template <typename... T> void print(const T &...t) {
     (void)std::initializer_list<int>{(std::cout << t << "", 0)...};
@@ -15,172 +34,3766 @@ struct Node;
 struct Traceable;
 struct ObjectHeader;
 
+// Objects tracing information: allocation pointer to header.
+static std::map<Traceable *, ObjectHeader> traceInfo;
+
+struct ObjectHeader {
+    bool marked;
+    bool pinned;
+    size_t size;
+    uint32_t type;
+};
+
+// Moved objects: old address to new one.
+using Forwarding = std::unordered_map<Traceable *, Traceable *>;
+
+/**
+ * Names of the object types, indexed by type id. Type 0 is for
+ * objects which don't declare their `GC_TYPE`.
+ */
+static std::vector<std::string> typeNames = {"Traceable"};
+
+uint32_t registerType(const char *mangledName);
+
+template <typename T> uint32_t gcTypeId() {
+    static const uint32_t id = registerType(typeid(T).name());
+    return id;
+}
+
+/**
+ * Class histogram: number and bytes of the objects of each type, by
+ * type id. Counted on allocation, and when an object is freed, so the
+ * objects found dead but not yet swept are still included.
+ */
+struct TypeCount {
+    long objects;
+    long bytes;
+};
+
+using HeapHistogram = std::vector<TypeCount>;
+
+static HeapHistogram histogram;
+
+/**
+ * Total size of the allocated objects, and the soft limit for it.
+ */
+static std::atomic<size_t> heapSize = 0;
+static size_t heapLimit = SIZE_MAX;
+
+/**
+ * Guards the heap structures (`traceInfo`, pages and holes)
+ * while pages are swept in the background.
+ */
+static std::mutex heapMutex;
+
+/**
+ * Number of allocations between the checks of the container
+ * memory pressure (see `underMemoryPressure`).
+ */
+static const size_t kPressureCheckInterval = 4096;
+static size_t allocationsUntilPressureCheck = kPressureCheckInterval;
+
+void gcReserve(size_t size);
+void allocateBlack(Traceable *object, size_t size);
+
+// The innermost open arena scope (see `GcArena`).
+struct GcArena;
+static GcArena *currentArena = nullptr;
+
+GcArena *arenaOf(const void *address);
+void *arenaAllocate(GcArena *arena, size_t size);
+bool checkArenaStore(const void *slot, const void *value);
+void forgetArenaSlot(const void *slot);
+
+// Allocation trace recording (see `gcStartRecording`).
+static bool recording = false;
+
+void recordAllocation(void *object, size_t size, uint32_t type, const void *site);
+void recordStore(const void *slot, const void *value);
+void recordRoots(const std::vector<Traceable *> &roots);
+
+/**
+ * The heap: a range of address space reserved up front, and used
+ * page by page. Small objects are allocated from the free holes of
+ * the pages (best fit), large ones take a span of whole pages.
+ */
+static const size_t kPageSize = 4096;
+static const size_t kHeapReserve = (32ull << 30) - kPageSize;
+static const size_t kLargeObjectSize = kPageSize / 2;
+static const size_t kObjectAlignment = sizeof(uintptr_t);
+
+enum class PageState : uint8_t {
+    Free,
+    Small,     // Objects up to `kLargeObjectSize`
+    Large,     // First page of a large object
+    LargeTail, // The rest of its pages
+    Young,     // Nursery (see `gcSetGenerational`)
+    Arena,     // Chunk of an open arena (see `GcArena`)
+};
+
+struct Page {
+    PageState state;
+    bool pinned;     // Has objects which can't be moved
+    bool evacuating; // Its objects are being moved out
+    bool unswept;    // Has dead objects of the last cycle
+    size_t span;     // Number of pages of a large object
+    size_t liveBytes;
+
+    // Free pages: collection since which it's free, and whether
+    // its memory was returned to the OS (see `decommitFreePages`).
+    size_t freeSince;
+    bool decommitted;
+};
+
+static uint8_t *heapBase = nullptr;
+static std::vector<Page> pages;
+static std::set<size_t> freePages;
+static size_t decommittedPages = 0;
+
+// Number of collections so far.
+static size_t collections = 0;
+
+// Free holes in the small pages: size to address.
+static std::multimap<size_t, uint8_t *> holes;
+
+inline uint8_t *pageStart(size_t page) { return heapBase + page * kPageSize; }
+
+inline size_t pageOf(const void *address) {
+    return ((uint8_t *)address - heapBase) / kPageSize;
+}
+
+/**
+ * Concurrent compaction state, checked by the `gc_ptr` load barrier
+ * without locking: whether objects are being moved while the mutator
+ * runs, and out of which pages.
+ */
+static std::atomic<bool> relocating{false};
+static std::atomic<bool> relocatingPages[kHeapReserve / kPageSize];
+
+inline bool isRelocating(const void *address) {
+    if (!relocating.load(std::memory_order_acquire)) {
+        return false;
+    }
+    auto offset = (size_t)((uint8_t *)address - heapBase);
+    return offset < kHeapReserve &&
+           relocatingPages[offset / kPageSize].load(std::memory_order_relaxed);
+}
+
+Traceable *relocateObject(Traceable *object);
+
+/**
+ * Region-based collection (see `gcSetRegions`): the heap is divided
+ * into regions of `kRegionPages` pages, and each region remembers the
+ * cards (`kCardSize` bytes of other regions) which may point into it.
+ */
+static const size_t kRegionPages = 8;
+static const size_t kRegionSize = kRegionPages * kPageSize;
+static const size_t kCardSize = 512;
+
+static bool regionMode = false;
+
+// Whether the marking runs concurrently with the mutator.
+static std::atomic<bool> marking{false};
+
+void rememberStore(const void *slot, const void *value);
+void satbEnqueue(const void *object);
+
+// Whether new objects are allocated in the nursery.
+static bool generational = false;
+
+void rememberYoung(const void *slot, const void *value);
+
+/**
+ * Compressed references: with `GC_COMPRESSED_REFS`, a `gc_ptr` stores
+ * a 32-bit offset in words from just below the heap base (0 is null),
+ * which covers the 32 GiB heap reservation, and halves pointer fields.
+ */
+#ifdef GC_COMPRESSED_REFS
+using Reference = uint32_t;
+
+inline Reference encodeReference(const void *address) {
+    return address == nullptr ? 0 : ((uint8_t *)address - heapBase) / kObjectAlignment + 1;
+}
+
+inline void *decodeReference(Reference reference) {
+    return reference == 0 ? nullptr : heapBase + (reference - 1) * kObjectAlignment;
+}
+#else
+using Reference = void *;
+
+inline Reference encodeReference(const void *address) { return (void *)address; }
+
+inline void *decodeReference(Reference reference) { return reference; }
+#endif
+
+/**
+ * Precise roots: with compressed references, a `gc_ptr` outside of the
+ * heap reservation (a local variable, e.g. the store of a `GcVector`
+ * on the stack, or in `malloc` memory) registers its slot here, since
+ * the conservative stack scan only finds full pointers. Decoding every
+ * 32-bit stack word instead would take small integers for references
+ * to the lowest objects, and keep them alive and pinned. Registering
+ * takes a lock, which makes such variables costlier than fields.
+ */
+#ifdef GC_COMPRESSED_REFS
+static std::mutex preciseRootsMutex;
+static std::unordered_set<const std::atomic<Reference> *> preciseRoots;
+
+inline bool isPreciseRoot(const void *slot) {
+    return (size_t)((uint8_t *)slot - heapBase) >= kHeapReserve;
+}
+
+inline void addPreciseRoot(const std::atomic<Reference> *slot) {
+    if (isPreciseRoot(slot)) {
+        std::lock_guard<std::mutex> lock(preciseRootsMutex);
+        preciseRoots.insert(slot);
+    }
+}
+
+inline void removePreciseRoot(const std::atomic<Reference> *slot) {
+    if (isPreciseRoot(slot)) {
+        std::lock_guard<std::mutex> lock(preciseRootsMutex);
+        preciseRoots.erase(slot);
+    }
+}
+#else
+inline void addPreciseRoot(const std::atomic<Reference> *) {}
+
+inline void removePreciseRoot(const std::atomic<Reference> *) {}
+#endif
+
+void reserveHeap() {
+    auto base = mmap(nullptr, kHeapReserve, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+        throw std::bad_alloc();
+    }
+    heapBase = (uint8_t *)base;
+}
+
+/**
+ * Takes `span` contiguous pages: the lowest run of free pages
+ * if there is one, otherwise from the unused part of the reservation.
+ */
+size_t takePages(size_t span, PageState state) {
+    size_t first = 0, run = 0;
+    for (auto page : freePages) {
+        if (run > 0 && page == first + run) {
+            run++;
+        } else {
+            first = page;
+            run = 1;
+        }
+        if (run == span) {
+            break;
+        }
+    }
+
+    if (run == span) {
+        for (auto page = first; page < first + span; page++) {
+            if (pages[page].decommitted) {
+                decommittedPages--;
+            }
+        }
+        freePages.erase(freePages.find(first), freePages.upper_bound(first + span - 1));
+    } else {
+        first = pages.size();
+        if ((first + span) * kPageSize > kHeapReserve) {
+            throw std::bad_alloc();
+        }
+        pages.resize(first + span);
+    }
+
+    for (size_t page = first; page < first + span; page++) {
+        pages[page] = Page{.state = page == first ? state : PageState::LargeTail,
+                           .pinned = false,
+                           .evacuating = false,
+                           .unswept = false,
+                           .span = span,
+                           .liveBytes = 0,
+                           .freeSince = 0,
+                           .decommitted = false};
+    }
+    return first;
+}
+
+void releasePages(size_t first) {
+    auto span = pages[first].span;
+    for (size_t page = first; page < first + span; page++) {
+        pages[page].state = PageState::Free;
+        pages[page].freeSince = collections;
+        freePages.insert(page);
+    }
+}
+
+/**
+ * Returns the free pages to the OS, so the resident memory follows the
+ * live objects. The memory is still reserved, and reads as zeros when
+ * the page is taken again. Against repeated returns and refaults under
+ * an oscillating load, a page is only returned after it stayed free
+ * for `kDecommitDelay` collections, and the lowest free pages (which
+ * are taken first) are kept, up to a quarter of the occupied ones.
+ */
+static const size_t kDecommitDelay = 2;
+
+void decommitFreePages() {
+    auto retained = (pages.size() - freePages.size()) / 4;
+    size_t kept = 0, first = 0, run = 0;
+    auto flush = [&]() {
+        if (run > 0) {
+            madvise(pageStart(first), run * kPageSize, MADV_DONTNEED);
+            run = 0;
+        }
+    };
+
+    for (auto page : freePages) {
+        if (pages[page].decommitted) {
+            continue;
+        }
+        if (kept < retained || collections - pages[page].freeSince < kDecommitDelay) {
+            kept++;
+            continue;
+        }
+        if (run > 0 && page != first + run) {
+            flush();
+        }
+        if (run == 0) {
+            first = page;
+        }
+        run++;
+        pages[page].decommitted = true;
+        decommittedPages++;
+    }
+    flush();
+}
+
+bool sweepNextPage();
+
+void *heapAllocate(size_t size) {
+    if (heapBase == nullptr) {
+        reserveHeap();
+    }
+
+    if (size > kLargeObjectSize) {
+        return pageStart(takePages((size + kPageSize - 1) / kPageSize, PageState::Large));
+    }
+
+    // While pages are swept in the background, sweep them
+    // here too, rather than growing the heap:
+    auto hole = holes.lower_bound(size);
+    while (hole == holes.end() && sweepNextPage()) {
+        hole = holes.lower_bound(size);
+    }
+    if (hole == holes.end()) {
+        hole = holes.emplace(kPageSize, pageStart(takePages(1, PageState::Small)));
+    }
+
+    auto [holeSize, address] = *hole;
+    holes.erase(hole);
+    if (holeSize > size) {
+        holes.emplace(holeSize - size, address + size);
+    }
+    return address;
+}
+
+/**
+ * The nursery: pages where the small objects are allocated by bumping
+ * a pointer, while `generational`. The survivors are copied out to the
+ * other pages by a scavenge (see `scavenge`) once the nursery is full.
+ */
+static const size_t kNurseryPages = 64;
+static std::vector<size_t> nurseryPages;
+static size_t nurseryPage = 0;
+static uint8_t *nurseryTop = nullptr;
+
+// Objects allocated outside of the nursery since the last scavenge.
+static std::vector<Traceable *> oldAllocations;
+
+// Old objects without exact fields: their stores have no barrier,
+// so every scavenge scans them (see `rebuildUntrackedObjects`).
+static std::set<Traceable *> untrackedObjects;
+
+bool nurseryHasRoom(size_t size) {
+    size = (size + kObjectAlignment - 1) & ~(kObjectAlignment - 1);
+    return nurseryTop + size <= pageStart(nurseryPages[nurseryPage]) + kPageSize ||
+           nurseryPage + 1 < nurseryPages.size();
+}
+
+void *nurseryAllocate(size_t size) {
+    if (nurseryTop + size > pageStart(nurseryPages[nurseryPage]) + kPageSize) {
+        if (nurseryPage + 1 == nurseryPages.size()) {
+            return heapAllocate(size);
+        }
+        nurseryTop = pageStart(nurseryPages[++nurseryPage]);
+    }
+    auto object = nurseryTop;
+    nurseryTop += size;
+    return object;
+}
+
+/**
+ * Adds the free holes of a page from its surviving objects. A page
+ * with no objects left is freed, and so are the pages of a dead large
+ * object. Evacuating pages get no holes.
+ */
+void rebuildPageFreeSpace(size_t page) {
+    auto state = pages[page].state;
+    if (state != PageState::Small && state != PageState::Large) {
+        return;
+    }
+
+    auto start = pageStart(page);
+    auto end = start + kPageSize;
+    auto object = traceInfo.lower_bound((Traceable *)start);
+
+    if (state == PageState::Large) {
+        if (object == traceInfo.end() || (uint8_t *)object->first != start) {
+            releasePages(page);
+        }
+        return;
+    }
+
+    if (object == traceInfo.end() || (uint8_t *)object->first >= end) {
+        releasePages(page);
+        return;
+    }
+
+    if (pages[page].evacuating) {
+        return;
+    }
+
+    auto free = start;
+    for (; object != traceInfo.end() && (uint8_t *)object->first < end; ++object) {
+        if ((uint8_t *)object->first > free) {
+            holes.emplace((uint8_t *)object->first - free, free);
+        }
+        free = (uint8_t *)object->first + object->second.size;
+    }
+    if (free < end) {
+        holes.emplace(end - free, free);
+    }
+}
+
+/**
+ * Recomputes the free holes of the whole heap.
+ */
+void rebuildFreeSpace() {
+    holes.clear();
+    for (size_t page = 0; page < pages.size(); page++) {
+        rebuildPageFreeSpace(page);
+    }
+}
+
+/**
+ * The `Traceable` struct is used as a base class
+ * for any object which should be managed by GC.
+ */
+struct Traceable {
+    ObjectHeader &getHeader() { return traceInfo.at(this); }
+
+    /**
+     * Collects the objects referenced from this object's fields.
+     *
+     * The default conservatively scans the object bytes. Classes
+     * which declare their `GC_FIELDS` get an exact version instead.
+     */
+    virtual void trace(std::vector<Traceable *> &pointers);
+
+    /**
+     * Whether `trace` is exact. Objects found by a conservative
+     * scan can't be moved, since the found words can't be updated.
+     */
+    virtual bool hasExactFields() { return false; }
+
+    /**
+     * Updates the pointer fields to the objects which were moved.
+     */
+    virtual void updatePointers(const Forwarding &) {}
+
+    __attribute__((noinline)) static void *operator new(size_t size) {
+        return allocate(size, 0, __builtin_return_address(0));
+    }
+
+    /**
+     * Allocates an object of the `type` (see `gcTypeId`), which is
+     * requested from the allocation `site`. In an arena scope, it goes
+     * to the arena of its `holder` (the slot it will be stored into),
+     * if it's known: e.g. a container's backing store stays on the GC
+     * heap unless the container is an arena object.
+     */
+    static void *allocate(size_t size, uint32_t type, const void *site,
+                          const void *holder = nullptr) {
+        if (currentArena != nullptr) {
+            auto arena = holder == nullptr ? currentArena : arenaOf(holder);
+            if (arena != nullptr) {
+                return arenaAllocate(arena, size);
+            }
+        }
+
+        // Collect first if we are over the limit, or short of memory:
+        gcReserve(size);
+
+        std::lock_guard<std::mutex> lock(heapMutex);
+
+        // Allocate a zeroed block (see `isConstructed`):
+        size = (size + kObjectAlignment - 1) & ~(kObjectAlignment - 1);
+        void *object = generational && size <= kLargeObjectSize ? nurseryAllocate(size)
+                                                                : heapAllocate(size);
+        memset(object, 0, size);
+
+        // Create an object header for it (marked, while marking):
+        auto header = ObjectHeader{.marked = marking, .pinned = false, .size = size, .type = type};
+        traceInfo.insert(std::make_pair((Traceable *)object, header));
+        heapSize += size;
+        if (histogram.size() <= type) {
+            histogram.resize(type + 1);
+        }
+        histogram[type].objects++;
+        histogram[type].bytes += size;
+        if (marking) {
+            allocateBlack((Traceable *)object, size);
+        }
+        if (generational && pages[pageOf(object)].state != PageState::Young) {
+            oldAllocations.push_back((Traceable *)object);
+        }
+
+        if (recording) {
+            recordAllocation(object, size, type, site);
+        }
+
+        return object;
+    }
+
+    /**
+     * The memory is reclaimed by the collector (see `rebuildFreeSpace`),
+     * the object is only left unconstructed (see `isConstructed`): so
+     * the sweep doesn't destroy it again, nor an object whose
+     * constructor threw (e.g. at an arena escape).
+     */
+    static void operator delete(void *object) { *(void **)object = nullptr; }
+
+    virtual ~Traceable(){};
+};
+
+/**
+ * A pointer field to a GC-managed object.
+ *
+ * Behaves as a plain `T *`, but lets `GC_FIELDS` find the field,
+ * and routes every store through a single place, which is where
+ * write barriers go.
+ */
+template <typename T> struct gc_ptr {
+    gc_ptr(T *ptr = nullptr) : ptr(encodeReference(ptr)) {
+        addPreciseRoot(&this->ptr);
+        if (recording && ptr != nullptr) {
+            recordStore(this, ptr);
+        }
+        remember(ptr);
+    }
+
+    gc_ptr(const gc_ptr &other) : gc_ptr(other.load()) {}
+
+    ~gc_ptr() {
+        removePreciseRoot(&ptr);
+        if (currentArena != nullptr) {
+            forgetArenaSlot(this);
+        }
+        if (recording) {
+            recordStore(this, nullptr);
+        }
+    }
+
+    gc_ptr &operator=(T *value) {
+        store(value);
+        return *this;
+    }
+
+    gc_ptr &operator=(const gc_ptr &other) {
+        store(other.load());
+        return *this;
+    }
+
+    T *get() const { return load(); }
+    T *operator->() const { return load(); }
+    T &operator*() const { return *load(); }
+    operator T *() const { return load(); }
+
+    // Points the field to the new place of a moved object.
+    // Done by the collector, so it's not a mutator store.
+    void relocate(T *moved) { ptr.store(encodeReference(moved), std::memory_order_relaxed); }
+
+private:
+    /**
+     * Load barrier: while the concurrent compaction moves the target,
+     * returns its new copy (making it first, if needed), and heals
+     * the field, unless the mutator stored something else meanwhile.
+     */
+    T *load() const {
+        auto reference = ptr.load(std::memory_order_relaxed);
+        auto value = static_cast<T *>(decodeReference(reference));
+        if (value != nullptr && isRelocating(value)) {
+            auto moved = static_cast<T *>(relocateObject(value));
+            ptr.compare_exchange_strong(reference, encodeReference(moved),
+                                        std::memory_order_acq_rel);
+            return moved;
+        }
+        return value;
+    }
+
+    /**
+     * Write barriers: while marking, the overwritten value is logged
+     * (snapshot at the beginning), and a pointer to another region
+     * is added to its remembered set.
+     */
+    void store(T *value) {
+        if (recording) {
+            recordStore(this, value);
+        }
+        if (marking.load(std::memory_order_relaxed)) {
+            satbEnqueue(decodeReference(ptr.load(std::memory_order_relaxed)));
+        }
+        remember(value);
+        ptr.store(encodeReference(value), std::memory_order_relaxed);
+    }
+
+    // Adds the pointer to the remembered sets.
+    void remember(T *value) {
+        if (value == nullptr) {
+            return;
+        }
+        if (currentArena != nullptr && checkArenaStore(this, value)) {
+            return;
+        }
+        if (regionMode) {
+            rememberStore(this, value);
+        }
+        if (generational) {
+            rememberYoung(this, value);
+        }
+    }
+
+    mutable std::atomic<Reference> ptr;
+};
+
+/**
+ * Field visitors used by the generated `trace` functions:
+ * a `gc_ptr` is followed, anything else is a plain value.
+ */
+template <typename T> inline void gcVisit(std::vector<Traceable *> &, const T &) {}
+
+template <typename T>
+inline void gcVisit(std::vector<Traceable *> &pointers, const gc_ptr<T> &field) {
+    if (field.get() != nullptr) {
+        pointers.emplace_back(field.get());
+    }
+}
+
+template <typename... Fields>
+inline void gcVisitFields(std::vector<Traceable *> &pointers, const Fields &...fields) {
+    (gcVisit(pointers, fields), ...);
+}
+
+/**
+ * Logs the references of a value which is dropped without a `gc_ptr`
+ * store (e.g. popped from a container), while marking.
+ */
+template <typename T> inline void gcPreWrite(const T &value) {
+    if (marking.load(std::memory_order_relaxed)) {
+        std::vector<Traceable *> pointers;
+        gcVisit(pointers, value);
+        for (auto pointer : pointers) {
+            satbEnqueue(pointer);
+        }
+    }
+}
+
+/**
+ * Field updaters used by the generated `updatePointers` functions.
+ */
+template <typename T> inline void gcUpdate(const Forwarding &, T &) {}
+
+template <typename T>
+inline void gcUpdate(const Forwarding &forwarding, gc_ptr<T> &field) {
+    if (field.get() == nullptr) {
+        return;
+    }
+    auto moved = forwarding.find(field.get());
+    if (moved != forwarding.end()) {
+        field.relocate(static_cast<T *>(moved->second));
+    }
+}
+
+template <typename... Fields>
+inline void gcUpdateFields(const Forwarding &forwarding, Fields &...fields) {
+    (gcUpdate(forwarding, fields), ...);
+}
+
+/**
+ * Generates the exact `trace` function of a class from the list
+ * of its fields, e.g. `GC_FIELDS(left, right)`. The visit of each
+ * field is unrolled and inlined at compile time. The same list
+ * gives `updatePointers`, used when objects are moved.
+ */
+#define GC_FIELDS(...)                                             \
+    void trace(std::vector<Traceable *> &pointers) override {      \
+        gcVisitFields(pointers, __VA_ARGS__);                      \
+    }                                                              \
+    bool hasExactFields() override { return true; }                \
+    void updatePointers(const Forwarding &forwarding) override {   \
+        gcUpdateFields(forwarding, __VA_ARGS__);                   \
+    }
+
+/**
+ * Gives the objects of a class their own type id, e.g. `GC_TYPE(Node)`,
+ * so allocations can be attributed to it.
+ */
+#define GC_TYPE(Class)                                                        \
+    __attribute__((noinline)) static void *operator new(size_t size) {       \
+        return allocate(size, gcTypeId<Class>(), __builtin_return_address(0)); \
+    }
+
+struct Node : public Traceable {
+    char name;
+
+    gc_ptr<Node> left;
+    gc_ptr<Node> right;
+
+    Node(char name, Node *left = nullptr, Node *right = nullptr)
+            : name(name), left(left), right(right) {
+        print("Constructing Node ", name);
+    }
+
+    virtual ~Node() { print("Destroying Node ", name); }
+
+    GC_TYPE(Node)
+    GC_FIELDS(left, right)
+};
+
+/**
+ * A list cell: a quiet object for the examples with larger heaps.
+ */
+struct Cell : public Traceable {
+    long value;
+    gc_ptr<Cell> next;
+
+    Cell(long value, Cell *next = nullptr) : value(value), next(next) {}
+
+    GC_TYPE(Cell)
+    GC_FIELDS(next)
+};
+
+/**
+ * A backing store of GC-aware containers: `capacity` slots, allocated
+ * on the GC heap inline after the array object itself. Only the first
+ * `length` (occupied) slots are traced.
+ */
+struct Slots {
+    size_t count;
+    const void *holder = nullptr; // See `Traceable::allocate`
+};
+
+template <typename T> struct GcArray : public Traceable {
+    static_assert(alignof(T) <= alignof(Traceable), "Over-aligned slot type");
+
+    // Read by the concurrent marking while the mutator pushes.
+    std::atomic<size_t> length;
+    size_t capacity;
+
+    // Allocated as `new (Slots{capacity, &holder}) GcArray<T>(capacity)`.
+    __attribute__((noinline)) static void *operator new(size_t size, Slots slots) {
+        return allocate(size + slots.count * sizeof(T), gcTypeId<GcArray<T>>(),
+                        __builtin_return_address(0), slots.holder);
+    }
+
+    explicit GcArray(size_t capacity) : length(0), capacity(capacity) {}
+
+    virtual ~GcArray() {
+        for (size_t i = 0; i < length; i++) {
+            slots()[i].~T();
+        }
+    }
+
+    T *slots() { return reinterpret_cast<T *>(this + 1); }
+
+    void trace(std::vector<Traceable *> &pointers) override {
+        for (size_t i = 0; i < length; i++) {
+            gcVisit(pointers, slots()[i]);
+        }
+    }
+
+    bool hasExactFields() override { return true; }
+
+    void updatePointers(const Forwarding &forwarding) override {
+        for (size_t i = 0; i < length; i++) {
+            gcUpdate(forwarding, slots()[i]);
+        }
+    }
+};
+
+/**
+ * A growable array with the backing store on the GC heap, e.g.
+ * `GcVector<gc_ptr<Node>>`. Can be used as a field (listed in
+ * `GC_FIELDS`), or as a local variable.
+ */
+template <typename T> struct GcVector {
+    gc_ptr<GcArray<T>> store;
+
+    size_t size() const { return store == nullptr ? 0 : store->length.load(); }
+
+    T &operator[](size_t index) { return store->slots()[index]; }
+
+    T *begin() { return store == nullptr ? nullptr : store->slots(); }
+    T *end() { return begin() + size(); }
+
+    void push_back(const T &value) {
+        if (store == nullptr || store->length == store->capacity) {
+            grow();
+        }
+        new (&store->slots()[store->length]) T(value);
+        store->length++;
+    }
+
+    void clear() { store = nullptr; }
+
+    void pop_back() {
+        store->length--;
+        gcPreWrite(store->slots()[store->length]);
+        store->slots()[store->length].~T();
+    }
+
+private:
+    // The old store is not freed: it becomes garbage for the next cycle.
+    void grow() {
+        auto capacity = store == nullptr ? 4 : store->capacity * 2;
+        auto bigger = new (Slots{capacity, &store}) GcArray<T>(capacity);
+        for (size_t i = 0; i < size(); i++) {
+            new (&bigger->slots()[i]) T(store->slots()[i]);
+        }
+        bigger->length = size();
+        store = bigger;
+    }
+};
+
+template <typename T>
+inline void gcVisit(std::vector<Traceable *> &pointers, const GcVector<T> &vector) {
+    gcVisit(pointers, vector.store);
+}
+
+template <typename T> inline void gcUpdate(const Forwarding &forwarding, GcVector<T> &vector) {
+    gcUpdate(forwarding, vector.store);
+}
+
+template <typename K, typename V> struct GcHashSlot {
+    bool used;
+    K key;
+    V value;
+};
+
+// Unused slots hold default (null) values, so `used` needn't be read,
+// and the concurrent marking doesn't race with the mutator on it.
+template <typename K, typename V>
+inline void gcVisit(std::vector<Traceable *> &pointers, const GcHashSlot<K, V> &slot) {
+    gcVisit(pointers, slot.key);
+    gcVisit(pointers, slot.value);
+}
+
+template <typename K, typename V>
+inline void gcUpdate(const Forwarding &forwarding, GcHashSlot<K, V> &slot) {
+    if (slot.used) {
+        gcUpdate(forwarding, slot.key);
+        gcUpdate(forwarding, slot.value);
+    }
+}
+
+/**
+ * Open-addressing hash map with linear probing, e.g.
+ * `GcHashMap<char, gc_ptr<Node>>`. Keys and values are stored
+ * inline in one GC-managed array, and only the used slots are traced.
+ */
+template <typename K, typename V> struct GcHashMap {
+    using Slot = GcHashSlot<K, V>;
+
+    gc_ptr<GcArray<Slot>> store;
+    size_t count = 0;
+
+    size_t size() const { return count; }
+
+    V *find(const K &key) {
+        if (store == nullptr) {
+            return nullptr;
+        }
+        for (auto i = indexOf(key);; i = next(i)) {
+            auto &slot = store->slots()[i];
+            if (!slot.used) {
+                return nullptr;
+            }
+            if (slot.key == key) {
+                return &slot.value;
+            }
+        }
+    }
+
+    void put(const K &key, const V &value) {
+        // Keep the load factor under 3/4.
+        if (store == nullptr || (count + 1) * 4 > store->capacity * 3) {
+            grow();
+        }
+        insert(key, value);
+    }
+
+    /**
+     * Removes the key, shifting the following entries of the probe
+     * sequence back, so no tombstones are needed.
+     */
+    bool erase(const K &key) {
+        if (find(key) == nullptr) {
+            return false;
+        }
+        auto slots = store->slots();
+        auto hole = indexOf(key);
+        while (!(slots[hole].key == key)) {
+            hole = next(hole);
+        }
+        for (auto i = next(hole); slots[i].used; i = next(i)) {
+            auto home = indexOf(slots[i].key);
+            // Move the entry into the hole, unless its home is within (hole, i].
+            if ((i > hole && (home <= hole || home > i)) ||
+                (i < hole && (home <= hole && home > i))) {
+                slots[hole] = slots[i];
+                hole = i;
+            }
+        }
+        slots[hole] = Slot{false, K(), V()};
+        count--;
+        return true;
+    }
+
+    void clear() {
+        store = nullptr;
+        count = 0;
+    }
+
+    void forEach(const std::function<void(const K &, V &)> &callback) {
+        if (store == nullptr) {
+            return;
+        }
+        for (size_t i = 0; i < store->capacity; i++) {
+            auto &slot = store->slots()[i];
+            if (slot.used) {
+                callback(slot.key, slot.value);
+            }
+        }
+    }
+
+private:
+    size_t indexOf(const K &key) const {
+        // Fibonacci hashing spreads poor hashes (e.g. of chars) over the table.
+        auto hash = std::hash<K>{}(key) * 11400714819323198485ull;
+        return (hash >> 32) & (store->capacity - 1);
+    }
+
+    size_t next(size_t index) const { return (index + 1) & (store->capacity - 1); }
+
+    void insert(const K &key, const V &value) {
+        auto i = indexOf(key);
+        auto slots = store->slots();
+        while (slots[i].used && !(slots[i].key == key)) {
+            i = next(i);
+        }
+        if (!slots[i].used) {
+            count++;
+        }
+        slots[i] = Slot{true, key, value};
+    }
+
+    // The old store is not freed: it becomes garbage for the next cycle.
+    void grow() {
+        auto old = store;
+        auto capacity = old == nullptr ? 8 : old->capacity * 2;
+        auto bigger = new (Slots{capacity, &store}) GcArray<Slot>(capacity);
+        for (size_t i = 0; i < capacity; i++) {
+            new (&bigger->slots()[i]) Slot{false, K(), V()};
+        }
+        bigger->length = capacity;
+        store = bigger;
+        count = 0;
+        if (old != nullptr) {
+            for (size_t i = 0; i < old->capacity; i++) {
+                if (old->slots()[i].used) {
+                    insert(old->slots()[i].key, old->slots()[i].value);
+                }
+            }
+        }
+    }
+};
+
+template <typename K, typename V>
+inline void gcVisit(std::vector<Traceable *> &pointers, const GcHashMap<K, V> &map) {
+    gcVisit(pointers, map.store);
+}
+
+template <typename K, typename V>
+inline void gcUpdate(const Forwarding &forwarding, GcHashMap<K, V> &map) {
+    gcUpdate(forwarding, map.store);
+}
+
+/**
+ * Nodes indexed by name: keeps all of them alive through the
+ * GC-managed containers, without linking them into a tree.
+ */
+struct NodeIndex : public Traceable {
+    GcVector<gc_ptr<Node>> nodes;
+    GcHashMap<char, gc_ptr<Node>> byName;
+
+    void add(Node *node) {
+        nodes.push_back(node);
+        byName.put(node->name, node);
+    }
+
+    GC_TYPE(NodeIndex)
+    GC_FIELDS(nodes, byName)
+};
+
+/**
+ * A node which links itself into its parent, as the right child.
+ */
+struct ChildNode : public Node {
+    ChildNode(char name, Node *parent) : Node(name) { parent->right = this; }
+};
+
+/**
+ * A GC-managed byte buffer, which the kernel can read or write into
+ * directly (`read`, `write`, `io_uring`), e.g. for network payloads.
+ *
+ * Buffers are allocated as large objects, which are never moved, so
+ * the data address stays valid. So even a small buffer takes a whole
+ * page (a buffer on a small page could be moved by a concurrent
+ * compaction between taking its data address and pinning it): small
+ * payloads should share a buffer, at offsets. While pinned, a buffer
+ * is also a root: it's kept alive by I/O in flight, even if only the
+ * data address is held (see `fromData`). Pins are counted without
+ * locking, except for the first one.
+ */
+struct GcBuffer : public Traceable {
+    size_t size;
+    std::atomic<uint32_t> pins;
+
+    // Allocated as `new (Slots{size}) GcBuffer(size)`.
+    __attribute__((noinline)) static void *operator new(size_t size, Slots bytes) {
+        return allocate(std::max(size + bytes.count, kLargeObjectSize + 1),
+                        gcTypeId<GcBuffer>(), __builtin_return_address(0));
+    }
+
+    explicit GcBuffer(size_t size) : size(size), pins(0) {}
+
+    uint8_t *data() { return reinterpret_cast<uint8_t *>(this + 1); }
+
+    static GcBuffer *fromData(void *data) { return reinterpret_cast<GcBuffer *>(data) - 1; }
+
+    void pin();
+    void unpin() { pins--; }
+
+    void trace(std::vector<Traceable *> &) override {}
+
+    bool hasExactFields() override { return true; }
+};
+
+// Buffers which were pinned, to check for roots (see `getRoots`).
+static std::set<GcBuffer *> pinnedBuffers;
+static std::mutex pinnedBuffersMutex;
+
+void GcBuffer::pin() {
+    if (pins++ == 0) {
+        std::lock_guard<std::mutex> lock(pinnedBuffersMutex);
+        pinnedBuffers.insert(this);
+    }
+}
+
+/**
+ * Keeps a buffer pinned for the scope, e.g. of a blocking `read`.
+ */
+struct GcPin {
+    GcBuffer *buffer;
+
+    explicit GcPin(GcBuffer *buffer) : buffer(buffer) { buffer->pin(); }
+    ~GcPin() { buffer->unpin(); }
+};
+
+void dump(const char *label) {
+    std::lock_guard<std::mutex> lock(heapMutex);
+
+    print("\n------------------------------------------------");
+    print(label);
+
+    print("\n{");
+
+    for (const auto &it : traceInfo) {
+        auto node = dynamic_cast<Node *>(it.first);
+
+        print("  [", node != nullptr ? node->name : '*', "] ", it.first, ": {.marked = ", it.second.marked,
+              ", .size = ", it.second.size, "}, ");
+    }
+
+    print("}\n");
+}
+
+/**
+ * A snapshot of the class histogram: a copy, without walking the heap.
+ */
+HeapHistogram gcHistogram() {
+    std::lock_guard<std::mutex> lock(heapMutex);
+    return histogram;
+}
+
+/**
+ * Changes from the `before` snapshot to the `after` one.
+ */
+HeapHistogram diffHistograms(const HeapHistogram &before, const HeapHistogram &after) {
+    HeapHistogram result(std::max(before.size(), after.size()), TypeCount{0, 0});
+    for (size_t type = 0; type < result.size(); type++) {
+        if (type < after.size()) {
+            result[type].objects += after[type].objects;
+            result[type].bytes += after[type].bytes;
+        }
+        if (type < before.size()) {
+            result[type].objects -= before[type].objects;
+            result[type].bytes -= before[type].bytes;
+        }
+    }
+    return result;
+}
+
+/**
+ * Prints the types with objects (or changes), most bytes first.
+ */
+void printHistogram(const char *label, const HeapHistogram &histogram) {
+    std::vector<uint32_t> types;
+    for (uint32_t type = 0; type < histogram.size(); type++) {
+        if (histogram[type].objects != 0 || histogram[type].bytes != 0) {
+            types.push_back(type);
+        }
+    }
+    std::sort(types.begin(), types.end(), [&](uint32_t a, uint32_t b) {
+        return std::abs(histogram[a].bytes) > std::abs(histogram[b].bytes);
+    });
+
+    print("\n", label);
+    for (auto type : types) {
+        print("  ", histogram[type].objects, " objects, ", histogram[type].bytes, " bytes: ",
+              typeNames[type]);
+    }
+}
+
+/**
+ * Go through object fields, and see if we have any
+ * which are recorded in the `traceInfo`.
+ */
+void Traceable::trace(std::vector<Traceable *> &pointers) {
+    auto p = (uint8_t *)this;
+    auto end = (p + getHeader().size);
+    while (p < end) {
+        auto address = (Traceable *)*(uintptr_t *)p;
+        if (traceInfo.count(address) != 0) {
+            pointers.emplace_back(address);
+        }
+#ifdef GC_COMPRESSED_REFS
+        // `gc_ptr` fields of objects without `GC_FIELDS`, which are
+        // aligned. Small integer fields are still taken for references
+        // to the lowest objects, which are then kept, and pinned.
+        if (((uintptr_t)p & (alignof(Reference) - 1)) == 0) {
+            auto compressed = (Traceable *)decodeReference(*(uint32_t *)p);
+            if (traceInfo.count(compressed) != 0) {
+                pointers.emplace_back(compressed);
+            }
+        }
+#endif
+        p++;
+    }
+}
+
+/**
+ * A collection can run while an object is allocated, but not yet
+ * constructed (e.g. while evaluating its constructor arguments).
+ * Such an object is still zeroed, so it has no vtable pointer.
+ */
+bool isConstructed(Traceable *object) { return *(void **)object != nullptr; }
+
+/**
+ * Returns the objects referenced from the `object` fields.
+ */
+std::vector<Traceable *> getPointers(Traceable *object) {
+    std::vector<Traceable *> result;
+    if (isConstructed(object)) {
+        object->trace(result);
+    }
+    return result;
+}
+
+/**
+ * An arena for request-local objects: while a `GcArenaScope` is open,
+ * new objects are bump-allocated from its chunks: pages of the heap
+ * reservation (so that compressed references reach them), which are
+ * not part of the GC heap. The collector neither traces nor sweeps
+ * them, and the pages are freed when the scope closes, after running
+ * the destructors.
+ *
+ * Arena objects may point to the GC heap: the `gc_ptr` stores of such
+ * pointers are kept as roots (pinned) while the arena is open. A store
+ * of an arena object into the GC heap, or into an outer arena, would
+ * outlive it, and throws `std::logic_error`. A `gc_ptr` elsewhere (e.g.
+ * on the stack) which still points into the arena when it closes is
+ * reset to null. Containers keep their backing store next to them: a
+ * container outside the arena can't hold arena objects.
+ */
+static const size_t kArenaChunkSize = 64 * 1024;
+
+struct GcArena {
+    GcArena *outer;
+
+    // Memory chunks with their sizes, and the free part of the last one.
+    std::vector<std::pair<uint8_t *, size_t>> chunks;
+    uint8_t *top = nullptr;
+    uint8_t *end = nullptr;
+
+    // Objects in allocation order, and the GC objects they point to.
+    std::vector<Traceable *> objects;
+    std::vector<Traceable *> references;
+
+    // The `gc_ptr`s outside the heap which were pointed into the arena.
+    std::set<const void *> outsideSlots;
+
+    bool contains(const void *address) const {
+        for (const auto &[chunk, size] : chunks) {
+            if (address >= chunk && address < chunk + size) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+void *arenaAllocate(GcArena *arena, size_t size) {
+    size = (size + kObjectAlignment - 1) & ~(kObjectAlignment - 1);
+    if (arena->top + size > arena->end) {
+        auto span = (std::max(size, kArenaChunkSize) + kPageSize - 1) / kPageSize;
+        std::lock_guard<std::mutex> lock(heapMutex);
+        if (heapBase == nullptr) {
+            reserveHeap();
+        }
+        auto chunk = pageStart(takePages(span, PageState::Arena));
+        auto chunkSize = span * kPageSize;
+        arena->chunks.emplace_back(chunk, chunkSize);
+        arena->top = chunk;
+        arena->end = chunk + chunkSize;
+    }
+
+    // Zeroed, as in the GC heap (see `isConstructed`):
+    auto object = arena->top;
+    arena->top += size;
+    memset(object, 0, size);
+    arena->objects.push_back((Traceable *)object);
+    return object;
+}
+
+// The open arena with the address, if any.
+GcArena *arenaOf(const void *address) {
+    for (auto arena = currentArena; arena != nullptr; arena = arena->outer) {
+        if (arena->contains(address)) {
+            return arena;
+        }
+    }
+    return nullptr;
+}
+
+/**
+ * Escape check of a `gc_ptr` store (or initialization), while an arena
+ * is open. Slots elsewhere (e.g. on the stack) can hold anything, and
+ * are reset when the arena closes, unless they are destroyed first.
+ * Returns whether the slot is in an arena: such a store isn't added
+ * to the remembered sets, since its target is a root anyway.
+ */
+bool checkArenaStore(const void *slot, const void *value) {
+    auto holder = arenaOf(slot);
+    auto target = arenaOf(value);
+    if (target == nullptr) {
+        if (holder != nullptr) {
+            holder->references.push_back((Traceable *)value);
+        }
+        return holder != nullptr;
+    }
+
+    // An arena closes before its outer ones:
+    for (auto arena = holder; arena != nullptr; arena = arena->outer) {
+        if (arena == target) {
+            return true;
+        }
+    }
+    if (holder != nullptr || (size_t)((uint8_t *)slot - heapBase) < kHeapReserve) {
+        throw std::logic_error("An arena object escapes its scope");
+    }
+    target->outsideSlots.insert(slot);
+    return false;
+}
+
+// A `gc_ptr` outside the heap is destroyed: it can't outlive an arena.
+// Heap slots are never remembered (and the background sweeping
+// destroys them on another thread).
+void forgetArenaSlot(const void *slot) {
+    if ((size_t)((uint8_t *)slot - heapBase) < kHeapReserve) {
+        return;
+    }
+    for (auto arena = currentArena; arena != nullptr; arena = arena->outer) {
+        arena->outsideSlots.erase(slot);
+    }
+}
+
+struct GcArenaScope {
+    GcArena arena;
+
+    GcArenaScope() {
+        arena.outer = currentArena;
+        currentArena = &arena;
+    }
+
+    ~GcArenaScope() {
+        currentArena = arena.outer;
+        for (auto slot : arena.outsideSlots) {
+            auto field = (std::atomic<Reference> *)slot;
+            if (arena.contains(decodeReference(field->load()))) {
+                field->store(encodeReference(nullptr));
+            }
+        }
+        for (auto it = arena.objects.rbegin(); it != arena.objects.rend(); ++it) {
+            if (isConstructed(*it)) {
+                delete *it;
+            }
+        }
+        std::lock_guard<std::mutex> lock(heapMutex);
+        for (const auto &[chunk, size] : arena.chunks) {
+            releasePages(pageOf(chunk));
+        }
+    }
+};
+
+/**
+ * Allocation trace: a binary file of fixed-size records, which
+ * can be replayed offline against other collector settings
+ * (see `simulateCollections`).
+ */
+static const char kTraceMagic[8] = {'G', 'C', 'T', 'R', 'A', 'C', 'E', '2'};
+
+enum class TraceEvent : uint32_t {
+    Type,       // `type` id, followed by `size` bytes of its name
+    Allocation, // `object` of `size` and `type`, from the `site`
+    Store,      // `object` stored into the `gc_ptr` at `site`
+    Free,       // `object` is swept
+    Collection, // `gc()` started
+    Move,       // `object` is moved to the `site`
+    Roots,      // The roots of a collection: `size` `Root` records follow
+    Root,       // `object` is a root
+};
+
+struct TraceRecord {
+    TraceEvent event;
+    uint32_t type;
+    uint64_t object;
+    uint64_t size;
+    uint64_t site;
+};
+
+static const size_t kTraceBufferSize = 4096;
+static std::vector<TraceRecord> traceBuffer;
+static std::ofstream traceFile;
+
+// Frees are recorded by the background sweeping too.
+static std::recursive_mutex traceMutex;
+
+void flushTrace() {
+    traceFile.write((const char *)traceBuffer.data(),
+                    traceBuffer.size() * sizeof(TraceRecord));
+    traceBuffer.clear();
+}
+
+void record(const TraceRecord &record) {
+    std::lock_guard<std::recursive_mutex> lock(traceMutex);
+    traceBuffer.push_back(record);
+    if (traceBuffer.size() == kTraceBufferSize) {
+        flushTrace();
+    }
+}
+
+void recordType(uint32_t type) {
+    std::lock_guard<std::recursive_mutex> lock(traceMutex);
+    auto &name = typeNames[type];
+    record({TraceEvent::Type, type, 0, name.size(), 0});
+    flushTrace();
+    traceFile.write(name.data(), name.size());
+}
+
+void recordAllocation(void *object, size_t size, uint32_t type, const void *site) {
+    record({TraceEvent::Allocation, type, (uint64_t)object, size, (uint64_t)site});
+}
+
+void recordStore(const void *slot, const void *value) {
+    record({TraceEvent::Store, 0, (uint64_t)value, 0, (uint64_t)slot});
+}
+
+void recordFree(void *object) { record({TraceEvent::Free, 0, (uint64_t)object, 0, 0}); }
+
+void recordCollection() { record({TraceEvent::Collection, 0, 0, 0, 0}); }
+
+void recordMove(void *object, void *moved) {
+    record({TraceEvent::Move, 0, (uint64_t)object, 0, (uint64_t)moved});
+}
+
+void recordRoots(const std::vector<Traceable *> &roots) {
+    std::lock_guard<std::recursive_mutex> lock(traceMutex);
+    record({TraceEvent::Roots, 0, 0, roots.size(), 0});
+    for (auto root : roots) {
+        record({TraceEvent::Root, 0, (uint64_t)root, 0, 0});
+    }
+}
+
+uint32_t registerType(const char *mangledName) {
+    int status;
+    auto name = abi::__cxa_demangle(mangledName, nullptr, nullptr, &status);
+    std::string typeName = status == 0 ? name : mangledName;
+    free(name);
+
+    // Already known, from a heap image (see `gcLoadImage`):
+    auto known = std::find(typeNames.begin(), typeNames.end(), typeName);
+    if (known != typeNames.end()) {
+        return known - typeNames.begin();
+    }
+
+    typeNames.push_back(typeName);
+    uint32_t type = typeNames.size() - 1;
+    if (recording) {
+        recordType(type);
+    }
+    return type;
+}
+
+/**
+ * Starts recording allocations (site, size and type), `gc_ptr`
+ * stores, frees and collections into the trace file at the `path`.
+ */
+void gcStartRecording(const char *path) {
+    traceFile.open(path, std::ios::binary | std::ios::trunc);
+    traceFile.write(kTraceMagic, sizeof(kTraceMagic));
+    for (uint32_t type = 0; type < typeNames.size(); type++) {
+        recordType(type);
+    }
+    recording = true;
+}
+
+void gcStopRecording() {
+    std::lock_guard<std::recursive_mutex> lock(traceMutex);
+    if (!recording) {
+        return;
+    }
+    recording = false;
+    flushTrace();
+    traceFile.close();
+}
+
+/**
+ * A collector configuration to replay a trace against.
+ */
+enum class SimulatedCollector {
+    MarkSweep, // Frees the dead objects in place
+    Copying,   // Copies the survivors out, and frees the rest at once
+};
+
+struct SimulationPolicy {
+    size_t threshold;   // Bytes allocated in the old space between full collections
+    size_t nurserySize; // Bytes, or 0 without a nursery
+    SimulatedCollector collector;
+};
+
+struct SimulationResult {
+    size_t collections;
+    size_t scavenges;
+    size_t peakHeapSize; // Including the nursery, and the copies of a copying collection
+    size_t copiedBytes;  // Promoted and copied survivors
+};
+
+/**
+ * Replays the trace at the `path` against the `policy`: a full
+ * collection runs after every `threshold` bytes allocated in the old
+ * space. With a nursery, the objects which fit in it are allocated
+ * there, and a scavenge promotes its survivors to the old space once
+ * it's full: their bytes count as allocated in the old space. A
+ * copying collector copies the surviving old objects, so its heap
+ * holds both copies while it runs.
+ *
+ * Each collection marks from the roots through the recorded `gc_ptr`
+ * stores, and frees the rest; a scavenge marks the nursery only, from
+ * the roots and the fields of the old objects. The frees of the
+ * recorded run are only used for the reuse of addresses. The roots are:
+ *
+ * - the ones recorded by the last collection of the recorded run,
+ * - the objects allocated since, until they are first stored into a
+ *   `gc_ptr` (before that, they can only be held by the stack),
+ * - and the targets of the `gc_ptr` variables outside of objects.
+ *
+ * Pointers which aren't `gc_ptr` fields aren't in the trace, so an
+ * object held only by one is taken as garbage.
+ */
+SimulationResult simulateCollections(const char *path, const SimulationPolicy &policy) {
+    std::ifstream file(path, std::ios::binary);
+    char magic[sizeof(kTraceMagic)];
+    if (!file.read(magic, sizeof(magic)) || memcmp(magic, kTraceMagic, sizeof(magic)) != 0) {
+        throw std::runtime_error("Not a GC trace file");
+    }
+
+    struct SimulatedObject {
+        uint64_t address;
+        size_t size;
+        bool live;
+        bool marked;
+        bool stored; // Into a `gc_ptr`
+        bool young;  // In the nursery
+        std::map<uint64_t, size_t> fields; // Offset to the target
+    };
+    std::vector<SimulatedObject> objects;
+    std::vector<size_t> live;
+
+    // Objects by the current address, and the slots outside of objects:
+    std::map<uint64_t, size_t> objectAt;
+    std::map<uint64_t, size_t> outerSlots;
+
+    std::vector<size_t> roots;
+    size_t allocatedSinceRoots = 0;
+
+    auto objectOf = [&](uint64_t address) {
+        auto it = objectAt.find(address);
+        return it == objectAt.end() ? SIZE_MAX : it->second;
+    };
+
+    SimulationResult result = {0, 0, 0, 0};
+    size_t oldBytes = 0, youngBytes = 0, allocated = 0;
+
+    auto notePeak = [&](size_t extra) {
+        result.peakHeapSize = std::max(result.peakHeapSize, oldBytes + policy.nurserySize + extra);
+    };
+
+    // Marks from the roots. A scavenge only marks the young objects,
+    // and the fields of the old ones are its roots too.
+    auto mark = [&](bool scavenge) {
+        std::vector<size_t> worklist(roots);
+        for (auto id = allocatedSinceRoots; id < objects.size(); id++) {
+            if (!objects[id].stored) {
+                worklist.push_back(id);
+            }
+        }
+        for (const auto &slot : outerSlots) {
+            worklist.push_back(slot.second);
+        }
+        if (scavenge) {
+            for (auto id : live) {
+                if (!objects[id].young) {
+                    for (const auto &field : objects[id].fields) {
+                        worklist.push_back(field.second);
+                    }
+                }
+            }
+        }
+        while (!worklist.empty()) {
+            auto &object = objects[worklist.back()];
+            worklist.pop_back();
+            if (!object.live || object.marked || (scavenge && !object.young)) {
+                continue;
+            }
+            object.marked = true;
+            for (const auto &field : object.fields) {
+                worklist.push_back(field.second);
+            }
+        }
+    };
+
+    // Frees the unmarked objects (of the nursery only, in a scavenge,
+    // which promotes the marked ones), and returns the bytes of the
+    // old survivors.
+    auto reclaim = [&](bool scavenge) {
+        size_t survived = 0;
+        auto survivors = live.begin();
+        for (auto id : live) {
+            auto &object = objects[id];
+            if (scavenge && !object.young) {
+                *survivors++ = id;
+                continue;
+            }
+            if (object.marked) {
+                object.marked = false;
+                *survivors++ = id;
+                if (scavenge) {
+                    object.young = false;
+                    youngBytes -= object.size;
+                    oldBytes += object.size;
+                    allocated += object.size;
+                    result.copiedBytes += object.size;
+                } else if (!object.young) {
+                    survived += object.size;
+                }
+                continue;
+            }
+            object.live = false;
+            object.fields.clear();
+            (object.young ? youngBytes : oldBytes) -= object.size;
+            if (objectOf(object.address) == id) {
+                objectAt.erase(object.address);
+            }
+        }
+        live.erase(survivors, live.end());
+        return survived;
+    };
+
+    auto collect = [&]() {
+        result.collections++;
+        allocated = 0;
+        mark(false);
+        auto survived = reclaim(false);
+        if (policy.collector == SimulatedCollector::Copying) {
+            // The copies were made before the old objects were freed:
+            notePeak(survived);
+            result.copiedBytes += survived;
+        }
+    };
+
+    auto scavenge = [&]() {
+        result.scavenges++;
+        mark(true);
+        reclaim(true);
+        notePeak(0);
+        if (allocated >= policy.threshold) {
+            collect();
+        }
+    };
+
+    TraceRecord record;
+    while (file.read((char *)&record, sizeof(record))) {
+        switch (record.event) {
+            case TraceEvent::Type:
+                file.ignore(record.size);
+                break;
+            case TraceEvent::Allocation: {
+                auto young = record.size <= policy.nurserySize;
+                if (young && youngBytes + record.size > policy.nurserySize) {
+                    scavenge();
+                }
+                objectAt[record.object] = objects.size();
+                live.push_back(objects.size());
+                objects.push_back({record.object, record.size, true, false, false, young, {}});
+                if (young) {
+                    youngBytes += record.size;
+                    break;
+                }
+                oldBytes += record.size;
+                allocated += record.size;
+                notePeak(0);
+                if (allocated >= policy.threshold) {
+                    collect();
+                }
+                break;
+            }
+            case TraceEvent::Store: {
+                auto target = record.object == 0 ? SIZE_MAX : objectOf(record.object);
+
+                // A field of an object, or else a slot outside of the objects:
+                auto slots = &outerSlots;
+                auto slot = record.site;
+                auto holder = objectAt.upper_bound(slot);
+                if (holder != objectAt.begin()) {
+                    const auto &object = objects[std::prev(holder)->second];
+                    if (slot < object.address + object.size) {
+                        slots = &objects[std::prev(holder)->second].fields;
+                        slot -= object.address;
+                    }
+                }
+                if (target == SIZE_MAX) {
+                    slots->erase(slot);
+                } else {
+                    (*slots)[slot] = target;
+                    objects[target].stored = true;
+                }
+                break;
+            }
+            case TraceEvent::Free:
+                // Dead in the recorded run: the address may be reused.
+                if (objectOf(record.object) != SIZE_MAX) {
+                    objectAt.erase(record.object);
+                }
+                break;
+            case TraceEvent::Move: {
+                auto id = objectOf(record.object);
+                if (id != SIZE_MAX) {
+                    objectAt.erase(record.object);
+                    objectAt[record.site] = id;
+                    objects[id].address = record.site;
+                }
+                break;
+            }
+            case TraceEvent::Roots:
+                roots.clear();
+                allocatedSinceRoots = objects.size();
+                break;
+            case TraceEvent::Root: {
+                auto id = objectOf(record.object);
+                if (id != SIZE_MAX) {
+                    roots.push_back(id);
+                }
+                break;
+            }
+            case TraceEvent::Collection:
+                break;
+        }
+    }
+    return result;
+}
+
+/**
+ * Frame pointer.
+ */
+intptr_t *__rbp;
+
+/**
+ * Stack pointer.
+ */
+intptr_t *__rsp;
+
+/**
+ * Main frame stack begin.
+ */
+intptr_t *__stackBegin;
+
+#if defined(__x86_64__)
+#define __READ_RBP() __asm__ volatile("mov %%rbp, %0" : "=r"(__rbp))
+#define __READ_RSP() __asm__ volatile("mov %%rsp, %0" : "=r"(__rsp))
+#else
+#define __READ_RBP() __asm__ volatile("mov %0, x29" : "=r"(__rbp))
+#define __READ_RSP() __asm__ volatile("mov %0, sp" : "=r"(__rsp))
+#endif
+
+void finishSweeping();
+void finishRelocating();
+void finishMarking();
+
+/**
+ * Initializes address of the main frame.
+ */
+void gcInit() {
+    // `main` frame pointer:
+    __READ_RBP();
+    __stackBegin = (intptr_t *)*__rbp;
+
+    // Recording mode: `GC_TRACE=<file>`.
+    if (auto path = getenv("GC_TRACE")) {
+        gcStartRecording(path);
+        atexit(gcStopRecording);
+    }
+
+    // The background work must be done before exit:
+    atexit(finishSweeping);
+    atexit(finishRelocating);
+    atexit(finishMarking);
+}
+
+/**
+ * Stack watermark: a copy of the stack as of the last scan, from its
+ * lowest address (the watermark) up to the main frame, and the roots
+ * found in it by their stack address.
+ *
+ * Frames below the watermark were pushed since, and are always
+ * scanned. The ones above it are compared with the copy, chunk by
+ * chunk: a chunk which didn't change (no frames were popped there,
+ * nor their variables written) keeps the roots found in it before.
+ * Deep frames of a recursion are then not scanned again.
+ *
+ * This saves the conservative scan (a `traceInfo` lookup at every
+ * byte), not the walk: the whole stack is still compared and copied
+ * on every collection, so the cost stays linear in the stack depth,
+ * only with a much smaller constant.
+ */
+static const size_t kStackChunk = 256;
+static std::vector<uint8_t> stackCopy;
+static std::multimap<const uint8_t *, Traceable *> stackRoots;
+
+// Bytes of the stack scanned by the last `getRoots`.
+static size_t stackBytesScanned = 0;
+
+void scanStack(const uint8_t *start, const uint8_t *end,
+               std::multimap<const uint8_t *, Traceable *> &roots) {
+    for (auto p = start; p < end; p++) {
+        auto address = (Traceable *)*(uintptr_t *)p;
+        if (traceInfo.count(address) != 0) {
+            roots.emplace(p, address);
+        }
+    }
+    stackBytesScanned += end - start;
+}
+
+/**
+ * Traverses the stacks to obtain the roots.
+ */
+std::vector<Traceable *> getRoots() {
+    // Some local variables (roots) can be stored in registers.
+    // Use `setjmp` to push them all onto the stack.
+    jmp_buf jb;
+    setjmp(jb);
+
+    __READ_RSP();
+    auto bottom = (uint8_t *)__rsp;
+    auto top = (uint8_t *)__stackBegin;
+    auto watermark = top - stackCopy.size();
+
+    // Chunks are counted from the top, which doesn't move. A word read
+    // at the end of a chunk spans into the next one, so it's compared too.
+    std::multimap<const uint8_t *, Traceable *> roots;
+    stackBytesScanned = 0;
+    for (auto end = top; end > bottom; end -= std::min(kStackChunk, (size_t)(end - bottom))) {
+        auto start = std::max(end - kStackChunk, bottom);
+        auto compared = std::min(end + sizeof(uintptr_t), top) - start;
+        if (start >= watermark &&
+            memcmp(start, stackCopy.data() + (start - watermark), compared) == 0) {
+            roots.insert(stackRoots.lower_bound(start), stackRoots.lower_bound(end));
+        } else {
+            scanStack(start, end, roots);
+        }
+    }
+
+    stackCopy.assign(bottom, top);
+    stackRoots = std::move(roots);
+
+    std::vector<Traceable *> result;
+    for (const auto &it : stackRoots) {
+        // Kept alive by the last scan, unless freed by other means:
+        if (traceInfo.count(it.second) != 0) {
+            result.emplace_back(it.second);
+        }
+    }
+
+#ifdef GC_COMPRESSED_REFS
+    {
+        std::lock_guard<std::mutex> lock(preciseRootsMutex);
+        for (auto slot : preciseRoots) {
+            auto object = (Traceable *)decodeReference(slot->load(std::memory_order_relaxed));
+            if (traceInfo.count(object) != 0) {
+                result.emplace_back(object);
+            }
+        }
+    }
+#endif
+
+    // GC objects pointed to from the open arenas:
+    for (auto arena = currentArena; arena != nullptr; arena = arena->outer) {
+        for (auto reference : arena->references) {
+            if (traceInfo.count(reference) != 0) {
+                result.emplace_back(reference);
+            }
+        }
+    }
+
+    // Pinned buffers. The pin count is read under the lock, so a buffer
+    // pinned again meanwhile is added back after it's dropped here.
+    std::lock_guard<std::mutex> lock(pinnedBuffersMutex);
+    for (auto it = pinnedBuffers.begin(); it != pinnedBuffers.end();) {
+        if ((*it)->pins == 0) {
+            it = pinnedBuffers.erase(it);
+        } else {
+            result.emplace_back(*it++);
+        }
+    }
+    if (recording) {
+        recordRoots(result);
+    }
+    return result;
+}
+
+/**
+ * Marks the reachable objects, and pins the ones which can't
+ * be moved: found by a conservative scan (of the stack, or of
+ * an object without `GC_FIELDS`), or still under construction.
+ */
+void mark() {
+    auto worklist = getRoots();
+    for (const auto &root : worklist) {
+        root->getHeader().pinned = true;
+    }
+
+    while (!worklist.empty()) {
+        auto o = worklist.back();
+        worklist.pop_back();
+        auto &header = o->getHeader();
+
+        if (!header.marked) {
+            header.marked = true;
+            if (!isConstructed(o)) {
+                header.pinned = true;
+            }
+            auto exact = isConstructed(o) && o->hasExactFields();
+            for (const auto &p : getPointers(o)) {
+                if (!exact) {
+                    p->getHeader().pinned = true;
+                }
+                worklist.push_back(p);
+            }
+        }
+    }
+}
+
+/**
+ * Fragmentation of the small pages after marking.
+ */
+struct HeapStats {
+    size_t liveObjects;
+    size_t liveBytes;
+    size_t occupiedPages;
+
+    // Free bytes in the occupied pages, and the part of them
+    // in holes too small for an average object.
+    size_t freeBytes;
+    size_t smallHoleBytes;
+
+    double utilization() const {
+        return occupiedPages == 0 ? 1 : (double)liveBytes / (occupiedPages * kPageSize);
+    }
+};
+
+/**
+ * Sums up the live bytes per page, marks the pages with pinned
+ * objects, and gets the sizes of the holes between live objects.
+ */
+HeapStats measureHeap() {
+    for (auto &page : pages) {
+        page.liveBytes = 0;
+        page.pinned = false;
+    }
+
+    HeapStats stats = {0, 0, 0, 0, 0};
+    std::vector<size_t> holeSizes;
+
+    // Objects are ordered by address, so the holes are
+    // the gaps between the consecutive live objects:
+    size_t current = SIZE_MAX;
+    uint8_t *free = nullptr;
+    auto closePage = [&]() {
+        if (current != SIZE_MAX && free < pageStart(current) + kPageSize) {
+            holeSizes.push_back(pageStart(current) + kPageSize - free);
+        }
+    };
+
+    for (const auto &it : traceInfo) {
+        auto page = pageOf(it.first);
+        if (it.second.pinned) {
+            pages[page].pinned = true;
+        }
+        if (!it.second.marked || pages[page].state != PageState::Small) {
+            continue;
+        }
+
+        if (page != current) {
+            closePage();
+            current = page;
+            free = pageStart(page);
+            stats.occupiedPages++;
+        }
+        if ((uint8_t *)it.first > free) {
+            holeSizes.push_back((uint8_t *)it.first - free);
+        }
+        free = (uint8_t *)it.first + it.second.size;
+
+        pages[page].liveBytes += it.second.size;
+        stats.liveObjects++;
+        stats.liveBytes += it.second.size;
+    }
+    closePage();
+
+    auto averageSize = stats.liveObjects == 0 ? 0 : stats.liveBytes / stats.liveObjects;
+    for (auto size : holeSizes) {
+        stats.freeBytes += size;
+        if (size < 2 * averageSize) {
+            stats.smallHoleBytes += size;
+        }
+    }
+    return stats;
+}
+
+/**
+ * How the garbage is reclaimed in a cycle.
+ */
+enum class ReclaimStrategy {
+    Sweep,    // Free dead objects in place
+    Evacuate, // Also move the objects out of the sparsest pages
+    Compact,  // Also move the objects out of all the pages
+};
+
+const char *strategyName(ReclaimStrategy strategy) {
+    switch (strategy) {
+        case ReclaimStrategy::Sweep:
+            return "sweep";
+        case ReclaimStrategy::Evacuate:
+            return "evacuate";
+        case ReclaimStrategy::Compact:
+            return "compact";
+    }
+    return "";
+}
+
+// Fragmentation (1 - utilization of the occupied pages) from
+// which the sparse pages are evacuated, and the heap is compacted:
+static const double kEvacuateFragmentation = 0.25;
+static const double kCompactFragmentation = 0.5;
+
+// Pages less utilized than this are evacuated:
+static const double kSparsePageUtilization = 0.5;
+
+/**
+ * Chooses the strategy by fragmentation. If most of the free space
+ * is in holes big enough for the average object, it's still usable,
+ * so the choice is one step less aggressive.
+ */
+ReclaimStrategy chooseStrategy(const HeapStats &stats) {
+    auto fragmentation = 1 - stats.utilization();
+    auto strategy = fragmentation < kEvacuateFragmentation  ? ReclaimStrategy::Sweep
+                    : fragmentation < kCompactFragmentation ? ReclaimStrategy::Evacuate
+                                                            : ReclaimStrategy::Compact;
+
+    if (strategy != ReclaimStrategy::Sweep && stats.smallHoleBytes * 2 < stats.freeBytes) {
+        strategy = strategy == ReclaimStrategy::Compact ? ReclaimStrategy::Evacuate
+                                                        : ReclaimStrategy::Sweep;
+    }
+    return strategy;
+}
+
+/**
+ * Pages to move the objects out of: the unpinned small pages with
+ * live objects, for `Evacuate` only the sparse ones.
+ */
+std::vector<size_t> pagesToEvacuate(ReclaimStrategy strategy) {
+    std::vector<size_t> result;
+    if (strategy == ReclaimStrategy::Sweep) {
+        return result;
+    }
+    for (size_t page = 0; page < pages.size(); page++) {
+        if (pages[page].state != PageState::Small || pages[page].pinned ||
+            pages[page].liveBytes == 0) {
+            continue;
+        }
+        if (strategy == ReclaimStrategy::Compact ||
+            pages[page].liveBytes < kSparsePageUtilization * kPageSize) {
+            result.push_back(page);
+        }
+    }
+    return result;
+}
+
+/**
+ * Frees the object if it's not marked, otherwise clears the mark
+ * for the next cycle. Returns the next object.
+ */
+std::map<Traceable *, ObjectHeader>::iterator sweepObject(
+        std::map<Traceable *, ObjectHeader>::iterator it) {
+    if (it->second.marked) {
+        it->second.marked = false;
+        it->second.pinned = false;
+        return ++it;
+    }
+
+    heapSize -= it->second.size;
+    histogram[it->second.type].objects--;
+    histogram[it->second.type].bytes -= it->second.size;
+    if (recording) {
+        recordFree(it->first);
+    }
+    untrackedObjects.erase(it->first);
+    if (isConstructed(it->first)) {
+        delete it->first;
+    }
+    return traceInfo.erase(it);
+}
+
+void sweep() {
+    auto it = traceInfo.begin();
+    while (it != traceInfo.end()) {
+        it = sweepObject(it);
+    }
+}
+
+/**
+ * Concurrent sweeping: `gc()` returns right after marking, and the
+ * pages are swept by a background thread. Only swept pages have free
+ * holes, so objects allocated meanwhile never land on unswept pages,
+ * and the sweeping never sees them. An allocation which finds no hole
+ * sweeps the next page itself, instead of growing the heap.
+ *
+ * Destructors of the dead objects run on the sweeping thread.
+ */
+static bool concurrentSweeping = false;
+static std::thread sweeper;
+
+// Pages to sweep in this cycle, and the next one to take.
+static std::vector<size_t> unsweptPages;
+static size_t nextUnsweptPage = 0;
+
+void gcSetConcurrentSweeping(bool enabled) { concurrentSweeping = enabled; }
+
+void sweepPage(size_t page) {
+    auto start = (Traceable *)pageStart(page);
+    auto end = (Traceable *)(pageStart(page) + pages[page].span * kPageSize);
+    auto it = traceInfo.lower_bound(start);
+    while (it != traceInfo.end() && it->first < end) {
+        it = sweepObject(it);
+    }
+    pages[page].unswept = false;
+    rebuildPageFreeSpace(page);
+}
+
+/**
+ * Sweeps the next unswept page, if any. Called with the `heapMutex`
+ * held, by the background thread or by an allocation.
+ */
+bool sweepNextPage() {
+    if (nextUnsweptPage == unsweptPages.size()) {
+        return false;
+    }
+    auto page = unsweptPages[nextUnsweptPage++];
+    if (pages[page].unswept) {
+        sweepPage(page);
+    }
+    return true;
+}
+
+/**
+ * Makes the pages of the objects unswept: they get free holes once
+ * swept, by `sweepNextPage`.
+ */
+void scheduleSweeping() {
+    holes.clear();
+    unsweptPages.clear();
+    nextUnsweptPage = 0;
+    for (size_t page = 0; page < pages.size(); page++) {
+        auto state = pages[page].state;
+        if (state == PageState::Small || state == PageState::Large) {
+            pages[page].unswept = true;
+            unsweptPages.push_back(page);
+        }
+    }
+}
+
+void startSweeping() {
+    scheduleSweeping();
+    sweeper = std::thread([]() {
+        while (true) {
+            std::lock_guard<std::mutex> lock(heapMutex);
+            if (!sweepNextPage()) {
+                return;
+            }
+        }
+    });
+}
+
+/**
+ * Waits for the background sweeping of the last cycle.
+ */
+void finishSweeping() {
+    if (sweeper.joinable()) {
+        sweeper.join();
+    }
+}
+
+/**
+ * Copies the object out of its evacuating page.
+ */
+Traceable *moveObject(Traceable *object) {
+    auto header = traceInfo.at(object);
+    auto moved = (Traceable *)heapAllocate(header.size);
+    memcpy((void *)moved, (void *)object, header.size);
+    traceInfo.erase(object);
+    traceInfo.emplace(moved, header);
+    if (recording) {
+        recordMove(object, moved);
+    }
+    if (untrackedObjects.erase(object) != 0) {
+        untrackedObjects.insert(moved);
+    }
+    return moved;
+}
+
+// Objects in the page, in address order.
+std::vector<Traceable *> objectsInPage(size_t page) {
+    std::vector<Traceable *> result;
+    auto end = (Traceable *)(pageStart(page) + kPageSize);
+    for (auto it = traceInfo.lower_bound((Traceable *)pageStart(page));
+         it != traceInfo.end() && it->first < end; ++it) {
+        result.push_back(it->first);
+    }
+    return result;
+}
+
+/**
+ * Moves the surviving objects out of the `from` pages into the
+ * holes of the other pages, and updates the pointers to them.
+ */
+void evacuate(const std::vector<size_t> &from) {
+    for (auto page : from) {
+        pages[page].evacuating = true;
+    }
+    rebuildFreeSpace();
+
+    Forwarding forwarding;
+    for (auto page : from) {
+        for (auto object : objectsInPage(page)) {
+            forwarding[object] = moveObject(object);
+        }
+    }
+
+    for (const auto &it : traceInfo) {
+        if (isConstructed(it.first)) {
+            it.first->updatePointers(forwarding);
+        }
+    }
+
+    for (auto page : from) {
+        pages[page].evacuating = false;
+    }
+    rebuildFreeSpace();
+}
+
+/**
+ * Concurrent compaction: the pause ends once the pages to evacuate
+ * are chosen, and a background thread moves their objects while the
+ * mutator runs. The mutator never sees an old copy: the `gc_ptr` load
+ * barrier moves the object itself if the thread didn't yet, and heals
+ * the loaded field. Objects found by the conservative stack scan are
+ * pinned, so the stack never needs updating.
+ *
+ * The remaining stale pointers are healed by the marking of the next
+ * cycle, which loads every reachable field through the barrier. Only
+ * then the evacuated pages are freed.
+ */
+static bool concurrentCompaction = false;
+static std::thread relocator;
+
+// Evacuated pages, and the forwarding table of each of them.
+static std::vector<size_t> relocatedPages;
+static std::map<size_t, Forwarding> forwardingTables;
+
+/**
+ * Returns the new copy of the object of an evacuated page,
+ * moving it now, if it's not moved yet.
+ */
+Traceable *relocateObject(Traceable *object) {
+    std::lock_guard<std::mutex> lock(heapMutex);
+    auto &forwarding = forwardingTables[pageOf(object)];
+    auto moved = forwarding.find(object);
+    if (moved != forwarding.end()) {
+        return moved->second;
+    }
+    return forwarding[object] = moveObject(object);
+}
+
+void startRelocating(const std::vector<size_t> &from) {
+    for (auto page : from) {
+        pages[page].evacuating = true;
+        relocatingPages[page] = true;
+    }
+    rebuildFreeSpace();
+    relocatedPages = from;
+    relocating = true;
+
+    relocator = std::thread([from]() {
+        for (auto page : from) {
+            std::vector<Traceable *> objects;
+            {
+                std::lock_guard<std::mutex> lock(heapMutex);
+                objects = objectsInPage(page);
+            }
+            for (auto object : objects) {
+                relocateObject(object);
+            }
+        }
+    });
+}
+
+/**
+ * Waits for the objects of the last cycle to be moved.
+ */
+void finishRelocating() {
+    if (relocator.joinable()) {
+        relocator.join();
+    }
+}
+
+/**
+ * Called after marking: no stale pointers are left, and the evacuated
+ * pages are freed with the next rebuild of the free space.
+ */
+void finishRemapping() {
+    if (!relocating) {
+        return;
+    }
+    relocating = false;
+    for (auto page : relocatedPages) {
+        relocatingPages[page] = false;
+        pages[page].evacuating = false;
+    }
+    relocatedPages.clear();
+    forwardingTables.clear();
+}
+
+/**
+ * Completes the concurrent compaction of the last cycle: the rest of
+ * the objects is moved, and a stop-the-world collection heals the
+ * stale pointers, as the marking of the next cycle would.
+ */
+void completeRelocation() {
+    finishRelocating();
+    if (!relocating) {
+        return;
+    }
+    finishSweeping();
+    mark();
+    finishRemapping();
+    sweep();
+    rebuildFreeSpace();
+}
+
+/**
+ * Enables the concurrent compaction. Disabling it completes the
+ * running one. Throws `std::logic_error` in the region mode (its
+ * marking thread would run the load barrier under the heap lock),
+ * or in the generational mode (see `gcSetGenerational`).
+ */
+void gcSetConcurrentCompaction(bool enabled) {
+    if (enabled && regionMode) {
+        throw std::logic_error("Concurrent compaction can't be combined with the region mode");
+    }
+    if (enabled && generational) {
+        throw std::logic_error("Concurrent compaction can't be combined with the generational mode");
+    }
+    if (!enabled) {
+        completeRelocation();
+    }
+    concurrentCompaction = enabled;
+}
+
+// Whether to dump the heap on each collection.
+static bool gcVerbose = true;
+
+/**
+ * Region-based collection ("garbage first"): marking runs in the
+ * background between the collections, and computes the live bytes
+ * of every region. A collection finishes the marking in a short
+ * remark pause, and evacuates only the regions with the most garbage
+ * which fit into what the remark left of the pause time goal. Pointers
+ * to the moved objects are found through the remembered sets of their
+ * regions, not by scanning the whole heap. The other regions are swept
+ * after the pause, by the marking thread of the next cycle before it
+ * marks, or by the allocations which find no free hole meanwhile (as
+ * with `gcSetConcurrentSweeping`).
+ *
+ * The marking traces a snapshot of the heap at its start: the write
+ * barrier logs the overwritten pointers, and the objects allocated
+ * meanwhile are marked right away. Objects without `GC_FIELDS` are
+ * traced in the remark pause, since their fields have no barrier.
+ */
+static std::thread marker;
+
+// Whether the marking thread is done (the remark is then short).
+static std::atomic<bool> markerFinished{false};
+
+// Pending objects of the marking, and the ones left for the remark.
+static std::vector<Traceable *> markStack;
+static std::vector<Traceable *> deferredObjects;
+
+// Objects allocated during the marking.
+static std::vector<Traceable *> blackObjects;
+
+// Pointers overwritten during the marking.
+static std::vector<Traceable *> satbQueue;
+static std::mutex satbMutex;
+
+// Cards with pointers into the region, by region.
+static std::map<size_t, std::set<size_t>> rememberedSets;
+static std::mutex rememberedSetMutex;
+
+// Number of objects marked in one hold of the `heapMutex`.
+static const size_t kMarkSlice = 256;
+
+// Regions with more live bytes than this are not evacuated:
+static const double kRegionLiveThreshold = 0.85;
+
+// Pause time goal of the evacuation, and its cost per copied byte
+// (or a scanned card byte), learned from the previous collections.
+static double pauseTimeGoal = 1.0;
+static double evacuationCostPerByte = 1e-4;
+
+void gcSetPauseTimeGoal(double milliseconds) { pauseTimeGoal = milliseconds; }
+
+inline size_t regionOf(const void *address) {
+    return ((uint8_t *)address - heapBase) / kRegionSize;
+}
+
+void rememberStore(const void *slot, const void *value) {
+    auto from = (size_t)((uint8_t *)slot - heapBase);
+    auto to = (size_t)((uint8_t *)value - heapBase);
+    if (from >= kHeapReserve || to >= kHeapReserve || from / kRegionSize == to / kRegionSize) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(rememberedSetMutex);
+    rememberedSets[to / kRegionSize].insert(from / kCardSize);
+}
+
+/**
+ * Adds the cards of the object to the remembered sets of
+ * the other regions it points into.
+ */
+void rememberObject(Traceable *object) {
+    auto first = ((uint8_t *)object - heapBase) / kCardSize;
+    auto last = ((uint8_t *)object - heapBase + traceInfo.at(object).size - 1) / kCardSize;
+    std::set<size_t> regions;
+    for (auto pointer : getPointers(object)) {
+        if (regionOf(pointer) != regionOf(object)) {
+            regions.insert(regionOf(pointer));
+        }
+    }
+    for (auto region : regions) {
+        auto &cards = rememberedSets[region];
+        for (auto card = first; card <= last; card++) {
+            cards.insert(card);
+        }
+    }
+}
+
+// Adds the objects which overlap the card.
+void objectsOnCard(size_t card, std::set<Traceable *> &objects) {
+    auto start = heapBase + card * kCardSize;
+    auto it = traceInfo.upper_bound((Traceable *)start);
+    if (it != traceInfo.begin() &&
+        (uint8_t *)std::prev(it)->first + std::prev(it)->second.size > start) {
+        --it;
+    }
+    for (; it != traceInfo.end() && (uint8_t *)it->first < start + kCardSize; ++it) {
+        objects.insert(it->first);
+    }
+}
+
+void rebuildRememberedSets() {
+    rememberedSets.clear();
+    for (const auto &it : traceInfo) {
+        rememberObject(it.first);
+    }
+}
+
+void satbEnqueue(const void *object) {
+    if (object != nullptr) {
+        std::lock_guard<std::mutex> lock(satbMutex);
+        satbQueue.push_back((Traceable *)object);
+    }
+}
+
+void drainSatbQueue() {
+    std::lock_guard<std::mutex> lock(satbMutex);
+    markStack.insert(markStack.end(), satbQueue.begin(), satbQueue.end());
+    satbQueue.clear();
+}
+
+/**
+ * Called by `allocate` (with the `heapMutex` held) during the marking.
+ */
+void allocateBlack(Traceable *object, size_t size) {
+    pages[pageOf(object)].liveBytes += size;
+    blackObjects.push_back(object);
+}
+
+void pinObject(Traceable *object) {
+    object->getHeader().pinned = true;
+    pages[pageOf(object)].pinned = true;
+}
+
+/**
+ * Marks the object and counts its live bytes. Returns false if it was
+ * already marked (or isn't an object).
+ */
+bool markObject(Traceable *object) {
+    auto it = traceInfo.find(object);
+    if (it == traceInfo.end() || it->second.marked) {
+        return false;
+    }
+    it->second.marked = true;
+    pages[pageOf(object)].liveBytes += it->second.size;
+    return true;
+}
+
+void markStep(Traceable *object) {
+    if (!markObject(object)) {
+        return;
+    }
+    if (!isConstructed(object) || !object->hasExactFields()) {
+        deferredObjects.push_back(object);
+        return;
+    }
+    object->trace(markStack);
+}
+
+// Traces the object in a pause, pinning what it points to,
+// as in `mark`.
+void traceConservatively(Traceable *object) {
+    if (!isConstructed(object)) {
+        pinObject(object);
+    }
+    for (auto pointer : getPointers(object)) {
+        pinObject(pointer);
+        markStack.push_back(pointer);
+    }
+}
+
+/**
+ * Initial mark pause: pins the roots, and starts the marking thread.
+ */
+void startMarking() {
+    for (auto &page : pages) {
+        page.liveBytes = 0;
+        page.pinned = false;
+    }
+    markStack.clear();
+    deferredObjects.clear();
+    blackObjects.clear();
+
+    // Nothing is marked in the pause, since the sweeping of the last
+    // cycle clears the marks. An object under construction, changed
+    // by the mutator without barriers, is left to the remark (see
+    // `markStep`):
+    for (auto root : getRoots()) {
+        pinObject(root);
+        markStack.push_back(root);
+    }
+
+    marking = true;
+    markerFinished = false;
+    marker = std::thread([]() {
+        // The pages left by the last cycle are swept first:
+        while (true) {
+            std::lock_guard<std::mutex> lock(heapMutex);
+            if (!sweepNextPage()) {
+                break;
+            }
+        }
+        while (true) {
+            std::lock_guard<std::mutex> lock(heapMutex);
+            drainSatbQueue();
+            if (markStack.empty()) {
+                markerFinished = true;
+                return;
+            }
+            for (size_t i = 0; i < kMarkSlice && !markStack.empty(); i++) {
+                auto object = markStack.back();
+                markStack.pop_back();
+                markStep(object);
+            }
+        }
+    });
+}
+
+/**
+ * Waits for the marking thread.
+ */
+void finishMarking() {
+    if (marker.joinable()) {
+        marker.join();
+    }
+}
+
+/**
+ * Remark pause: marks what was left after the marking thread (the
+ * logged pointers, the objects without exact fields), and pins the
+ * roots and the targets of conservative traces.
+ */
+void remark() {
+    finishMarking();
+    marking = false;
+    drainSatbQueue();
+
+    for (auto root : getRoots()) {
+        pinObject(root);
+        markStack.push_back(root);
+    }
+    for (auto object : blackObjects) {
+        if (!isConstructed(object) || !object->hasExactFields()) {
+            traceConservatively(object);
+        }
+    }
+
+    while (!markStack.empty() || !deferredObjects.empty()) {
+        while (!markStack.empty()) {
+            auto object = markStack.back();
+            markStack.pop_back();
+            markStep(object);
+        }
+        while (!deferredObjects.empty()) {
+            auto object = deferredObjects.back();
+            deferredObjects.pop_back();
+            traceConservatively(object);
+        }
+    }
+}
+
+/**
+ * Live bytes and remembered cards of a region (if it can be evacuated).
+ */
+struct RegionInfo {
+    size_t region;
+    size_t liveBytes;
+    size_t garbageBytes;
+    size_t cards;
+
+    double cost() const { return (liveBytes + cards * kCardSize) * evacuationCostPerByte; }
+};
+
+/**
+ * Chooses the regions with the most garbage, while their predicted
+ * evacuation time fits into the `budget` (ms). Regions with large
+ * objects, pinned objects or mostly live bytes are not evacuated.
+ */
+std::vector<RegionInfo> regionsToEvacuate(double budget) {
+    std::vector<RegionInfo> candidates;
+    for (size_t first = 0; first < pages.size(); first += kRegionPages) {
+        RegionInfo info = {first / kRegionPages, 0, 0, 0};
+        size_t usedPages = 0;
+        bool movable = true;
+        for (auto page = first; page < std::min(first + kRegionPages, pages.size()); page++) {
+            if (pages[page].state == PageState::Free) {
+                continue;
+            }
+            movable = movable && pages[page].state == PageState::Small && !pages[page].pinned;
+            usedPages++;
+            info.liveBytes += pages[page].liveBytes;
+        }
+        if (!movable || usedPages == 0 ||
+            info.liveBytes > kRegionLiveThreshold * usedPages * kPageSize) {
+            continue;
+        }
+        info.garbageBytes = usedPages * kPageSize - info.liveBytes;
+        info.cards = rememberedSets[info.region].size();
+        candidates.push_back(info);
+    }
+
+    std::sort(candidates.begin(), candidates.end(), [](const auto &a, const auto &b) {
+        return a.garbageBytes > b.garbageBytes;
+    });
+
+    std::vector<RegionInfo> result;
+    double cost = 0;
+    for (const auto &info : candidates) {
+        if (cost + info.cost() > budget) {
+            break;
+        }
+        cost += info.cost();
+        result.push_back(info);
+    }
+    return result;
+}
+
+// Small pages of the regions.
+std::vector<size_t> regionPages(const std::vector<RegionInfo> &regions) {
+    std::vector<size_t> result;
+    for (const auto &info : regions) {
+        for (auto page = info.region * kRegionPages;
+             page < std::min((info.region + 1) * kRegionPages, pages.size()); page++) {
+            if (pages[page].state == PageState::Small) {
+                result.push_back(page);
+            }
+        }
+    }
+    return result;
+}
+
+/**
+ * Moves the objects out of the regions, and updates the pointers to
+ * them: in the moved objects themselves, and in the remembered cards.
+ * The pages of the regions must have no free holes (see `evacuating`).
+ */
+void evacuateRegions(const std::vector<RegionInfo> &regions) {
+    std::set<size_t> from;
+    for (const auto &info : regions) {
+        from.insert(info.region);
+    }
+    auto fromPages = regionPages(regions);
+
+    Forwarding forwarding;
+    std::vector<Traceable *> moved;
+    for (auto page : fromPages) {
+        for (auto object : objectsInPage(page)) {
+            moved.push_back(forwarding[object] = moveObject(object));
+        }
+    }
+    for (auto object : moved) {
+        object->updatePointers(forwarding);
+    }
+
+    // Objects of the remembered cards outside the evacuated regions:
+    std::set<Traceable *> referrers;
+    for (auto region : from) {
+        for (auto card : rememberedSets[region]) {
+            if (from.count(regionOf(heapBase + card * kCardSize)) == 0) {
+                objectsOnCard(card, referrers);
+            }
+        }
+        rememberedSets.erase(region);
+    }
+    for (auto object : referrers) {
+        if (isConstructed(object)) {
+            object->updatePointers(forwarding);
+            rememberObject(object);
+        }
+    }
+    // The copies stay marked for the sweeping of their pages, which
+    // still uses the marks of this cycle:
+    for (auto object : moved) {
+        rememberObject(object);
+        traceInfo.at(object).marked = true;
+    }
+
+    for (auto page : fromPages) {
+        pages[page].evacuating = false;
+        releasePages(page);
+    }
+}
+
+/**
+ * Enables the region-based collection, and starts the first marking.
+ * Disabling it completes the running marking cycle. Throws
+ * `std::logic_error` with the concurrent compaction enabled (see
+ * `gcSetConcurrentCompaction`), or in the generational mode.
+ */
+void gcSetRegions(bool enabled) {
+    if (enabled && concurrentCompaction) {
+        throw std::logic_error("The region mode can't be combined with concurrent compaction");
+    }
+    if (enabled && generational) {
+        throw std::logic_error("The region mode can't be combined with the generational mode");
+    }
+    if (!enabled && marking) {
+        remark();
+        sweep();
+        rebuildFreeSpace();
+        rememberedSets.clear();
+    }
+    if (enabled && !regionMode) {
+        finishSweeping();
+        rebuildRememberedSets();
+        regionMode = true;
+        startMarking();
+    }
+    regionMode = enabled;
+}
+
+/**
+ * A region-based collection: the remark pause, and the evacuation of
+ * the chosen regions, which are swept first (or the sweeping and the
+ * compaction of the whole heap, with `forceCompaction`). The next
+ * marking starts right after, and sweeps the rest of the heap first.
+ */
+void collectRegions(bool forceCompaction) {
+    auto start = std::chrono::steady_clock::now();
+    auto since = [](std::chrono::steady_clock::time_point time) {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - time)
+                .count();
+    };
+
+    // Nothing can be reclaimed before the marking is done: rather than
+    // waiting for it in the pause, the next collection takes over.
+    if (!forceCompaction && marking && !markerFinished) {
+        if (gcVerbose) {
+            print("\nMarking still runs, no collection");
+        }
+        return;
+    }
+
+    // A cycle which didn't start marking yet is marked in the pause:
+    if (!marking) {
+        startMarking();
+    }
+    remark();
+
+    if (forceCompaction) {
+        sweep();
+        evacuate(pagesToEvacuate(ReclaimStrategy::Compact));
+        rebuildRememberedSets();
+        startMarking();
+        return;
+    }
+
+    auto remarkTime = since(start);
+    auto regions = regionsToEvacuate(pauseTimeGoal - remarkTime);
+    auto fromPages = regionPages(regions);
+    size_t work = 0;
+    for (const auto &info : regions) {
+        work += info.liveBytes + info.cards * kCardSize;
+    }
+
+    auto evacuationStart = std::chrono::steady_clock::now();
+    for (auto page : fromPages) {
+        pages[page].evacuating = true;
+        sweepPage(page);
+    }
+    // Their holes left by the background sweeping are dropped too:
+    for (auto hole = holes.begin(); hole != holes.end();) {
+        hole = pages[pageOf(hole->second)].evacuating ? holes.erase(hole) : std::next(hole);
+    }
+    evacuateRegions(regions);
+    for (auto page : fromPages) {
+        pages[page].evacuating = false;
+    }
+    auto evacuationTime = since(evacuationStart);
+    if (work > 0) {
+        evacuationCostPerByte = (evacuationCostPerByte + evacuationTime / work) / 2;
+    }
+
+    scheduleSweeping();
+    startMarking();
+    if (gcVerbose) {
+        print("\nEvacuated ", regions.size(), " regions in a ", since(start), " ms pause (remark ",
+              remarkTime, " ms)");
+    }
+}
+
+/**
+ * Generational mode: small objects are allocated in the nursery, and
+ * the survivors are promoted (copied out to the old pages) when it's
+ * full. The scavenge only traces from the roots in the nursery, and
+ * from the old objects remembered to point into it.
+ *
+ * It runs on `scavengeThreads` threads. Each scans the objects of its
+ * own queue, and steals from the other queues when it runs out. An
+ * object is forwarded by the thread which wins the CAS of its first
+ * word (the vtable pointer) to the tagged address of its copy; the
+ * copy goes to the thread's promotion-local allocation buffer, and
+ * the headers of the copies are added to `traceInfo` after the threads
+ * join. Objects without exact fields, and what they point to, are
+ * pinned: they stay, and their nursery pages are promoted as they are.
+ *
+ * Not combined with the region mode or the concurrent compaction:
+ * the scavenge threads read `traceInfo` without locking, while the
+ * load barrier of a relocation would change it.
+ */
+static size_t scavengeThreads = std::max(1u, std::thread::hardware_concurrency());
+
+// Cards of the old objects which may point into the nursery.
+static std::set<size_t> youngRememberedSet;
+
+// Number of the scavenges, and their total time.
+static size_t scavengeCount = 0;
+static double scavengeMilliseconds = 0;
+
+void gcSetScavengeThreads(size_t threads) { scavengeThreads = std::max<size_t>(threads, 1); }
+
+inline bool isYoung(const void *address) {
+    auto offset = (size_t)((uint8_t *)address - heapBase);
+    return offset < pages.size() * kPageSize &&
+           pages[offset / kPageSize].state == PageState::Young;
+}
+
+void rememberYoung(const void *slot, const void *value) {
+    auto offset = (size_t)((uint8_t *)slot - heapBase);
+    if (offset < kHeapReserve && isYoung(value) && !isYoung(slot)) {
+        youngRememberedSet.insert(offset / kCardSize);
+    }
+}
+
+void rebuildUntrackedObjects() {
+    untrackedObjects.clear();
+    for (const auto &it : traceInfo) {
+        if (!isYoung(it.first) && (!isConstructed(it.first) || !it.first->hasExactFields())) {
+            untrackedObjects.insert(it.first);
+        }
+    }
+}
+
+// Pages for the promotion-local allocation buffers, taken before
+// the scavenge threads start, and the next one to take.
+static std::vector<size_t> plabPool;
+static std::atomic<size_t> nextPlabPage{0};
+
+/**
+ * Promotion-local allocation buffer: a page of the pool,
+ * allocated by bumping a pointer.
+ */
+struct Plab {
+    uint8_t *top = nullptr;
+    uint8_t *end = nullptr;
+
+    void *allocate(size_t size) {
+        if (top + size > end) {
+            top = pageStart(plabPool[nextPlabPage++]);
+            end = top + kPageSize;
+        }
+        auto object = top;
+        top += size;
+        return object;
+    }
+
+    // Takes back the last allocation.
+    void undo(void *object, size_t size) {
+        if ((uint8_t *)object + size == top) {
+            top = (uint8_t *)object;
+        }
+    }
+};
+
+struct ScavengeWorker {
+    std::mutex mutex;
+    std::deque<Traceable *> queue;
+    Plab plab;
+
+    // Original and copy of the objects forwarded by this thread.
+    std::vector<std::pair<Traceable *, Traceable *>> moves;
+};
+
+static std::vector<std::unique_ptr<ScavengeWorker>> scavengeWorkers;
+
+// Objects queued, and not yet scanned.
+static std::atomic<size_t> pendingObjects{0};
+
+// Pinned nursery objects reached by the scavenge.
+static std::set<Traceable *> reachedPinned;
+static std::mutex reachedPinnedMutex;
+
+void pushObject(ScavengeWorker &worker, Traceable *object) {
+    pendingObjects++;
+    std::lock_guard<std::mutex> lock(worker.mutex);
+    worker.queue.push_back(object);
+}
+
+/**
+ * Takes the newest object of the own queue, or steals
+ * the oldest one of another queue.
+ */
+Traceable *takeObject(size_t self) {
+    for (size_t i = 0; i < scavengeWorkers.size(); i++) {
+        auto &worker = *scavengeWorkers[(self + i) % scavengeWorkers.size()];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        if (worker.queue.empty()) {
+            continue;
+        }
+        Traceable *object;
+        if (i == 0) {
+            object = worker.queue.back();
+            worker.queue.pop_back();
+        } else {
+            object = worker.queue.front();
+            worker.queue.pop_front();
+        }
+        return object;
+    }
+    return nullptr;
+}
+
+/**
+ * Returns the copy of the nursery object, copying it first
+ * if no thread did it yet.
+ */
+Traceable *forwardObject(ScavengeWorker &worker, Traceable *object) {
+    auto word = (uintptr_t *)object;
+    auto value = __atomic_load_n(word, __ATOMIC_ACQUIRE);
+    if ((value & 1) != 0) {
+        return (Traceable *)(value & ~(uintptr_t)1);
+    }
+
+    // The first word is copied as it was read, the rest can't change:
+    auto size = traceInfo.find(object)->second.size;
+    auto copy = (uint8_t *)worker.plab.allocate(size);
+    memcpy(copy + sizeof(uintptr_t), (uint8_t *)object + sizeof(uintptr_t),
+           size - sizeof(uintptr_t));
+    *(uintptr_t *)copy = value;
+
+    if (__atomic_compare_exchange_n(word, &value, (uintptr_t)copy | 1, false, __ATOMIC_ACQ_REL,
+                                    __ATOMIC_ACQUIRE)) {
+        worker.moves.emplace_back(object, (Traceable *)copy);
+        pushObject(worker, (Traceable *)copy);
+        return (Traceable *)copy;
+    }
+    worker.plab.undo(copy, size);
+    return (Traceable *)(value & ~(uintptr_t)1);
+}
+
+/**
+ * Forwards the nursery objects the object points to, and updates
+ * its fields to their copies.
+ */
+void scanObject(ScavengeWorker &worker, Traceable *object) {
+    Forwarding forwarding;
+    for (auto pointer : getPointers(object)) {
+        if (!isYoung(pointer)) {
+            continue;
+        }
+        if (traceInfo.find(pointer)->second.pinned) {
+            std::lock_guard<std::mutex> lock(reachedPinnedMutex);
+            if (reachedPinned.insert(pointer).second) {
+                pushObject(worker, pointer);
+            }
+        } else {
+            forwarding[pointer] = forwardObject(worker, pointer);
+        }
+    }
+    if (!forwarding.empty()) {
+        object->updatePointers(forwarding);
+    }
+}
+
+void scavengeWorker(size_t self) {
+    while (true) {
+        if (auto object = takeObject(self)) {
+            scanObject(*scavengeWorkers[self], object);
+            pendingObjects--;
+        } else if (pendingObjects == 0) {
+            return;
+        } else {
+            std::this_thread::yield();
+        }
+    }
+}
+
+/**
+ * Promotes the survivors of the nursery, and frees the rest of it.
+ */
+void scavenge() {
+    finishSweeping();
+    finishRelocating();
+    auto start = std::chrono::steady_clock::now();
+
+    for (auto object : oldAllocations) {
+        if (traceInfo.count(object) != 0 &&
+            (!isConstructed(object) || !object->hasExactFields())) {
+            untrackedObjects.insert(object);
+        }
+    }
+    oldAllocations.clear();
+
+    // Pin what can't be moved, before any object is:
+    std::vector<Traceable *> nursery;
+    for (auto page : nurseryPages) {
+        auto objects = objectsInPage(page);
+        nursery.insert(nursery.end(), objects.begin(), objects.end());
+    }
+    auto pin = [](Traceable *object) {
+        if (isYoung(object)) {
+            object->getHeader().pinned = true;
+        }
+    };
+    for (auto object : nursery) {
+        if (!isConstructed(object) || !object->hasExactFields()) {
+            pin(object);
+            for (auto pointer : getPointers(object)) {
+                pin(pointer);
+            }
+        }
+    }
+    for (auto object : untrackedObjects) {
+        for (auto pointer : getPointers(object)) {
+            pin(pointer);
+        }
+    }
+    auto roots = getRoots();
+    for (auto root : roots) {
+        pin(root);
+    }
+
+    // The roots and the remembered objects are spread over the threads:
+    scavengeWorkers.clear();
+    for (size_t i = 0; i < scavengeThreads; i++) {
+        scavengeWorkers.push_back(std::make_unique<ScavengeWorker>());
+    }
+    reachedPinned.clear();
+    size_t next = 0;
+    for (auto root : roots) {
+        if (isYoung(root) && reachedPinned.insert(root).second) {
+            pushObject(*scavengeWorkers[next++ % scavengeThreads], root);
+        }
+    }
+    auto remembered = untrackedObjects;
+    for (auto card : youngRememberedSet) {
+        objectsOnCard(card, remembered);
+    }
+    for (auto object : remembered) {
+        if (!isYoung(object)) {
+            pushObject(*scavengeWorkers[next++ % scavengeThreads], object);
+        }
+    }
+
+    // A buffer page is at least half full, since the objects in the
+    // nursery are up to half a page:
+    plabPool.clear();
+    nextPlabPage = 0;
+    for (size_t i = 0; i < 2 * (nurseryPage + 1) + scavengeThreads; i++) {
+        plabPool.push_back(takePages(1, PageState::Small));
+    }
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < scavengeThreads; i++) {
+        threads.emplace_back(scavengeWorker, i);
+    }
+    scavengeWorker(0);
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    // Headers of the copies, in one batch:
+    size_t promotedBytes = 0;
+    for (const auto &worker : scavengeWorkers) {
+        for (const auto &[original, copy] : worker->moves) {
+            auto header = traceInfo.at(original);
+            traceInfo.emplace(copy, header);
+            promotedBytes += header.size;
+            if (recording) {
+                recordMove(original, copy);
+            }
+        }
+    }
+
+    // Forwarded objects are gone, unreached ones are dead, and the
+    // pages with reached pinned objects are promoted as they are:
+    std::set<size_t> promotedPages;
+    for (auto object : nursery) {
+        auto it = traceInfo.find(object);
+        if ((*(uintptr_t *)object & 1) != 0) {
+            traceInfo.erase(it);
+        } else if (reachedPinned.count(object) != 0) {
+            it->second.pinned = false;
+            promotedPages.insert(pageOf(object));
+            if (!isConstructed(object) || !object->hasExactFields()) {
+                untrackedObjects.insert(object);
+            }
+        } else {
+            sweepObject(it);
+        }
+    }
+    for (auto &page : nurseryPages) {
+        if (promotedPages.count(page) != 0) {
+            pages[page].state = PageState::Small;
+            rebuildPageFreeSpace(page);
+            page = takePages(1, PageState::Young);
+        }
+    }
+    for (size_t i = 0; i < plabPool.size(); i++) {
+        if (i < nextPlabPage) {
+            rebuildPageFreeSpace(plabPool[i]);
+        } else {
+            releasePages(plabPool[i]);
+        }
+    }
+
+    nurseryPage = 0;
+    nurseryTop = pageStart(nurseryPages[0]);
+    youngRememberedSet.clear();
+
+    auto elapsed = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - start).count();
+    scavengeCount++;
+    scavengeMilliseconds += elapsed;
+    if (gcVerbose) {
+        print("\nScavenged ", nursery.size(), " objects, ", promotedBytes, " bytes promoted in ",
+              elapsed, " ms");
+    }
+}
+
+/**
+ * Enables the generational mode. Disabling it promotes
+ * the survivors, and frees the nursery. Throws `std::logic_error`
+ * in the region mode, or with the concurrent compaction enabled.
+ */
+void gcSetGenerational(bool enabled) {
+    if (enabled == generational) {
+        return;
+    }
+    if (enabled && (regionMode || concurrentCompaction)) {
+        throw std::logic_error(
+                "The generational mode can't be combined with the region mode or concurrent "
+                "compaction");
+    }
+    if (enabled) {
+        if (heapBase == nullptr) {
+            reserveHeap();
+        }
+        for (size_t i = 0; i < kNurseryPages; i++) {
+            nurseryPages.push_back(takePages(1, PageState::Young));
+        }
+        nurseryPage = 0;
+        nurseryTop = pageStart(nurseryPages[0]);
+        rebuildUntrackedObjects();
+        youngRememberedSet.clear();
+        generational = true;
+    } else {
+        scavenge();
+        generational = false;
+        for (auto page : nurseryPages) {
+            releasePages(page);
+        }
+        nurseryPages.clear();
+        untrackedObjects.clear();
+    }
+}
+
+/**
+ * Runs a collection. After marking, the fragmentation decides
+ * whether to only sweep, or also to evacuate the sparse pages,
+ * or to compact the heap (always, with `forceCompaction`).
+ */
+void runCollection(bool forceCompaction) {
+    finishSweeping();
+    finishRelocating();
+    collections++;
+    {
+        // The marking thread may still sweep pages in the region mode:
+        std::lock_guard<std::mutex> lock(heapMutex);
+        decommitFreePages();
+    }
+    if (generational) {
+        scavenge();
+    }
+    if (recording) {
+        recordCollection();
+    }
+    if (regionMode) {
+        collectRegions(forceCompaction);
+        return;
+    }
+    mark();
+    finishRemapping();
+    if (gcVerbose) {
+        dump("After mark:");
+    }
+
+    auto stats = measureHeap();
+    auto strategy = forceCompaction ? ReclaimStrategy::Compact : chooseStrategy(stats);
+    auto from = pagesToEvacuate(strategy);
+
+    if (concurrentCompaction && !forceCompaction && !from.empty()) {
+        sweep();
+        startRelocating(from);
+        if (gcVerbose) {
+            print("\nUtilization ", stats.utilization(), ", ", strategyName(strategy), " (",
+                  from.size(), " of ", stats.occupiedPages, " pages in the background)");
+        }
+        return;
+    }
+
+    // Moving objects needs the world stopped till the end:
+    if (concurrentSweeping && from.empty()) {
+        startSweeping();
+        if (gcVerbose) {
+            print("\nUtilization ", stats.utilization(), ", sweeping in the background");
+        }
+        return;
+    }
+
+    sweep();
+    if (from.empty()) {
+        rebuildFreeSpace();
+    } else {
+        evacuate(from);
+    }
+
+    if (gcVerbose) {
+        print("\nUtilization ", stats.utilization(), ", ", strategyName(strategy), " (",
+              from.size(), " of ", stats.occupiedPages, " pages evacuated)");
+        dump("After sweep:");
+    }
+}
+
+// Pause of the last collection without forced compaction (what `gcIdle`
+// runs), and the heap size right after the last collection.
+static double lastCollectionMilliseconds = 0;
+static size_t heapSizeAfterCollection = 0;
+
+void collect(bool forceCompaction) {
+    auto start = std::chrono::steady_clock::now();
+    runCollection(forceCompaction);
+    if (!forceCompaction) {
+        lastCollectionMilliseconds = std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - start).count();
+    }
+    heapSizeAfterCollection = heapSize;
+}
+
+void gc() { collect(false); }
+
+void gcCompact() { collect(true); }
+
+/**
+ * Soft caches: callbacks which drop references to objects that
+ * can be recomputed. They are cleared only when the heap limit
+ * can't be met otherwise.
+ */
+static std::vector<std::function<void()>> softCaches;
+
+void gcAddSoftCache(const std::function<void()> &clear) {
+    softCaches.push_back(clear);
+}
+
+void gcSetHeapLimit(size_t limit) { heapLimit = limit; }
+
+/**
+ * Container (cgroup v2) memory state.
+ */
+static const char *kMemoryPressureFile = "/sys/fs/cgroup/memory.pressure";
+static const char *kMemoryCurrentFile = "/sys/fs/cgroup/memory.current";
+static const char *kMemoryMaxFile = "/sys/fs/cgroup/memory.max";
+
+// Collect early when tasks stall on memory for this % of the time:
+static double memoryPressureThreshold = 10.0;
+
+// Collect early when this fraction of the container limit is used:
+static double memoryUsageThreshold = 0.9;
+
+/**
+ * Reads the `some avg10` value of the memory pressure stall
+ * information: % of time in the last 10 seconds some task waited
+ * for memory. Returns 0 if PSI is not available.
+ */
+double readMemoryPressure() {
+    std::ifstream file(kMemoryPressureFile);
+    std::string kind, avg10;
+    while (file >> kind >> avg10) {
+        if (kind == "some" && avg10.compare(0, 6, "avg10=") == 0) {
+            return std::stod(avg10.substr(6));
+        }
+        file.ignore(SIZE_MAX, '\n');
+    }
+    return 0;
+}
+
+/**
+ * Returns `memory.current / memory.max` of the container,
+ * or 0 if there is no limit.
+ */
+double readMemoryUsage() {
+    std::ifstream current(kMemoryCurrentFile), max(kMemoryMaxFile);
+    std::string used, limit;
+    if (!(current >> used) || !(max >> limit) || limit == "max") {
+        return 0;
+    }
+    return std::stod(used) / std::stod(limit);
+}
+
+/**
+ * Resident memory of the process, in bytes.
+ */
+size_t readResidentBytes() {
+    std::ifstream statm("/proc/self/statm");
+    size_t size = 0, resident = 0;
+    statm >> size >> resident;
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+bool underMemoryPressure() {
+    return readMemoryPressure() >= memoryPressureThreshold ||
+           readMemoryUsage() >= memoryUsageThreshold;
+}
+
+void clearSoftCaches() {
+    for (const auto &clear : softCaches) {
+        clear();
+    }
+}
 
-// Objects tracing information: allocation pointer to header.
-static std::map<Traceable *, ObjectHeader> traceInfo;
+/**
+ * Makes room for a `size` bytes allocation.
+ *
+ * Over the heap limit, runs an emergency collection; if it's not
+ * enough, clears the soft caches and collects again, and then fails.
+ * Every `kPressureCheckInterval` allocations also checks the container
+ * memory, and collects early if it's close to the limit.
+ */
+void gcReserve(size_t size) {
+    if (generational && size <= kLargeObjectSize && !nurseryHasRoom(size)) {
+        scavenge();
+    }
 
-struct ObjectHeader {
-    bool marked;
-    size_t size;
-};
+    if (heapSize + size > heapLimit) {
+        gcCompact();
+        if (heapSize + size > heapLimit) {
+            clearSoftCaches();
+            gcCompact();
+        }
+        if (heapSize + size > heapLimit) {
+            throw std::bad_alloc();
+        }
+    }
+
+    if (--allocationsUntilPressureCheck == 0) {
+        allocationsUntilPressureCheck = kPressureCheckInterval;
+        if (underMemoryPressure()) {
+            gc();
+        }
+    }
+}
 
 /**
- * The `Traceable` struct is used as a base class
- * for any object which should be managed by GC.
+ * Heap images: the heap saved to a file by `gcSaveImage`, and mapped
+ * copy-on-write by `gcLoadImage` at the start of another run of the
+ * same executable, instead of building the objects again.
+ *
+ * The file has the page table, the objects (offset, size, type and
+ * vtable), the type names, the roots, and then the heap pages, aligned
+ * so that they can be mapped. The heap is mapped at its old base if
+ * that address range is free, and then the pointers are still valid;
+ * otherwise the exact fields are moved by the difference (compressed
+ * references are offsets, and need nothing). Vtable pointers are
+ * rewritten only where the executable was loaded at another address.
  */
-struct Traceable {
-    ObjectHeader &getHeader() { return traceInfo.at(this); }
+static const char kImageMagic[8] = {'G', 'C', 'I', 'M', 'A', 'G', 'E', '1'};
 
-    static void *operator new(size_t size) {
-        // Allocate a block:
-        void *object = ::operator new(size);
+// Of the heap pages in the file, for `mmap` with larger system pages.
+static const size_t kImageAlignment = 64 * 1024;
 
-        // Create an object header for it:
-        auto header = ObjectHeader{.marked = false, .size = size};
-        traceInfo.insert(std::make_pair((Traceable *)object, header));
+struct ImageHeader {
+    char magic[8];
+    uint64_t base;
+    uint64_t pageCount;
+    uint64_t objectCount;
+    uint64_t typeCount;
+    uint64_t rootCount;
+    uint64_t heapOffset;
+    int64_t executable; // See `imageExecutable`
+};
 
-        return object;
-    }
+struct ImagePage {
+    PageState state;
+    uint64_t span;
+};
 
-    virtual ~Traceable(){};
+struct ImageObject {
+    uint64_t offset;
+    uint64_t size;
+    uint32_t type;
+    int64_t vtable; // Relative to `imageAnchor`
 };
 
-struct Node : public Traceable {
-    char name;
+// Vtables are at a fixed distance from this function in the executable.
+uintptr_t imageAnchor() { return (uintptr_t)&imageAnchor; }
 
-    Node *left;
-    Node *right;
+// The vtable pointer of a polymorphic object, read as bytes.
+uintptr_t vtableOf(const void *object) {
+    uintptr_t vtable;
+    memcpy(&vtable, object, sizeof(vtable));
+    return vtable;
+}
 
-    Node(char name, Node *left = nullptr, Node *right = nullptr)
-            : name(name), left(left), right(right) {
-        print("Constructing Node ", name);
+// Tells the executables apart: where a vtable is, relative to the anchor.
+int64_t imageExecutable() {
+    static const Traceable probe;
+    return vtableOf(&probe) - imageAnchor();
+}
+
+/**
+ * Saves the heap, after a compacting collection, and the `roots`
+ * into an image file at the `path`. The objects must not point
+ * outside the heap (e.g. to `malloc` memory), and no arena can be open.
+ */
+void gcSaveImage(const char *path, const std::vector<Traceable *> &roots) {
+    if (currentArena != nullptr) {
+        throw std::logic_error("A heap image can't be saved in an arena scope");
     }
+    gcCompact();
+    std::lock_guard<std::mutex> lock(heapMutex);
 
-    virtual ~Node() { print("Destroying Node ", name); }
-};
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file) {
+        throw std::runtime_error(std::string("Can't write the heap image ") + path);
+    }
 
-void dump(const char *label) {
-    print("\n------------------------------------------------");
-    print(label);
+    ImageHeader header;
+    memcpy(header.magic, kImageMagic, sizeof(kImageMagic));
+    header.base = (uint64_t)heapBase;
+    header.pageCount = pages.size();
+    header.objectCount = traceInfo.size();
+    header.typeCount = typeNames.size();
+    header.rootCount = roots.size();
+    header.heapOffset = 0;
+    header.executable = imageExecutable();
+    file.write((const char *)&header, sizeof(header));
 
-    print("\n{");
+    // The nursery is empty after the collection:
+    for (const auto &page : pages) {
+        auto state = page.state == PageState::Young ? PageState::Free : page.state;
+        ImagePage saved = {state, page.span};
+        file.write((const char *)&saved, sizeof(saved));
+    }
 
     for (const auto &it : traceInfo) {
-        auto node = reinterpret_cast<Node *>(it.first);
+        ImageObject saved = {
+            .offset = (uint64_t)((uint8_t *)it.first - heapBase),
+            .size = it.second.size,
+            .type = it.second.type,
+            .vtable = (int64_t)(vtableOf(it.first) - imageAnchor()),
+        };
+        file.write((const char *)&saved, sizeof(saved));
+    }
 
-        print("  [", node->name, "] ", it.first, ": {.marked = ", it.second.marked,
-              ", .size = ", it.second.size, "}, ");
+    for (const auto &name : typeNames) {
+        uint32_t length = name.size();
+        file.write((const char *)&length, sizeof(length));
+        file.write(name.data(), length);
     }
 
-    print("}\n");
-}
+    for (auto root : roots) {
+        uint64_t offset = (uint8_t *)root - heapBase;
+        file.write((const char *)&offset, sizeof(offset));
+    }
 
-/**
- * Go through object fields, and see if we have any
- * which are recorded in the `traceInfo`.
- */
-std::vector<Traceable *> getPointers(Traceable *object) {
-    auto p = (uint8_t *)object;
-    auto end = (p + object->getHeader().size);
-    std::vector<Traceable *> result;
-    while (p < end) {
-        auto address = (Traceable *)*(uintptr_t *)p;
-        if (traceInfo.count(address) != 0) {
-            result.emplace_back(address);
-        }
-        p++;
+    // The heap pages, padded to whole mappable blocks:
+    static const char zeros[kImageAlignment] = {};
+    auto position = (uint64_t)file.tellp();
+    header.heapOffset = (position + kImageAlignment - 1) & ~(kImageAlignment - 1);
+    file.write(zeros, header.heapOffset - position);
+
+    auto bytes = pages.size() * kPageSize;
+    file.write((const char *)heapBase, bytes);
+    file.write(zeros, (kImageAlignment - bytes % kImageAlignment) % kImageAlignment);
+
+    file.seekp(0);
+    file.write((const char *)&header, sizeof(header));
+    if (!file) {
+        throw std::runtime_error(std::string("Can't write the heap image ") + path);
     }
-    return result;
 }
 
 /**
- * Frame pointer.
+ * Maps the heap image at the `path` into the (still empty) heap,
+ * and returns its roots, in the order they were saved. Keep them in
+ * local variables: the returned vector isn't scanned for roots.
  */
-intptr_t *__rbp;
+std::vector<Traceable *> gcLoadImage(const char *path) {
+    std::lock_guard<std::mutex> lock(heapMutex);
+    if (!traceInfo.empty() || !pages.empty()) {
+        throw std::logic_error("A heap image can only be loaded into an empty heap");
+    }
 
-/**
- * Stack pointer.
- */
-intptr_t *__rsp;
+    std::ifstream file(path, std::ios::binary);
+    ImageHeader header;
+    if (!file.read((char *)&header, sizeof(header)) ||
+        memcmp(header.magic, kImageMagic, sizeof(kImageMagic)) != 0) {
+        throw std::runtime_error(std::string("Not a heap image: ") + path);
+    }
+    if (header.executable != imageExecutable()) {
+        throw std::runtime_error(std::string("The heap image is of another executable: ") + path);
+    }
 
-/**
- * Main frame stack begin.
- */
-intptr_t *__stackBegin;
+    std::vector<ImagePage> savedPages(header.pageCount);
+    std::vector<ImageObject> objects(header.objectCount);
+    file.read((char *)savedPages.data(), savedPages.size() * sizeof(ImagePage));
+    file.read((char *)objects.data(), objects.size() * sizeof(ImageObject));
 
-#define __READ_RBP() __asm__ volatile("mov %0, x29" : "=r"(__rbp))
-#define __READ_RSP() __asm__ volatile("mov %0, sp" : "=r"(__rsp))
+    // Saved type ids to the ones of this run:
+    std::vector<uint32_t> types(header.typeCount);
+    for (auto &type : types) {
+        uint32_t length;
+        file.read((char *)&length, sizeof(length));
+        std::string name(length, '\0');
+        file.read(name.data(), length);
 
-/**
- * Initializes address of the main frame.
- */
-void gcInit() {
-    // `main` frame pointer:
-    __READ_RBP();
-    __stackBegin = (intptr_t *)*__rbp;
-}
+        auto known = std::find(typeNames.begin(), typeNames.end(), name);
+        if (known == typeNames.end()) {
+            typeNames.push_back(name);
+            known = typeNames.end() - 1;
+        }
+        type = known - typeNames.begin();
+    }
 
-/**
- * Traverses the stacks to obtain the roots.
- */
-std::vector<Traceable *> getRoots() {
-    std::vector<Traceable *> result;
+    std::vector<uint64_t> roots(header.rootCount);
+    file.read((char *)roots.data(), roots.size() * sizeof(uint64_t));
+    if (!file) {
+        throw std::runtime_error(std::string("Truncated heap image: ") + path);
+    }
 
-    // Some local variables (roots) can be stored in registers.
-    // Use `setjmp` to push them all onto the stack.
-    jmp_buf jb;
-    setjmp(jb);
+    // Reserve the heap at its old base if we can:
+    if (heapBase == nullptr) {
+        auto base = mmap((void *)header.base, kHeapReserve, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (base == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+        heapBase = (uint8_t *)base;
+    }
 
-    __READ_RSP();
-    auto rsp = (uint8_t *)__rsp;
-    auto top = (uint8_t *)__stackBegin;
+    // The pages are read from the file only when touched, and copied
+    // only when written:
+    auto bytes = header.pageCount * kPageSize;
+    if (bytes > 0) {
+        auto fd = open(path, O_RDONLY);
+        auto mapped = fd < 0 ? MAP_FAILED
+                             : mmap(heapBase, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                                    fd, header.heapOffset);
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (mapped == MAP_FAILED) {
+            throw std::runtime_error(std::string("Can't map the heap image ") + path);
+        }
+    }
 
-    while (rsp < top) {
-        auto address = (Traceable *)*(uintptr_t *)rsp;
-        if (traceInfo.count(address) != 0) {
-            result.emplace_back(address);
+    for (size_t page = 0; page < savedPages.size(); page++) {
+        pages.push_back(Page{.state = savedPages[page].state,
+                             .pinned = false,
+                             .evacuating = false,
+                             .unswept = false,
+                             .span = savedPages[page].span,
+                             .liveBytes = 0,
+                             .freeSince = collections,
+                             .decommitted = false});
+        if (savedPages[page].state == PageState::Free) {
+            freePages.insert(page);
+        }
+    }
+
+    auto vtableBase = imageAnchor();
+    for (const auto &saved : objects) {
+        auto object = (Traceable *)(heapBase + saved.offset);
+        auto type = types[saved.type];
+        traceInfo.insert(std::make_pair(
+            object, ObjectHeader{.marked = false, .pinned = false, .size = saved.size, .type = type}));
+        heapSize += saved.size;
+        if (histogram.size() <= type) {
+            histogram.resize(type + 1);
+        }
+        histogram[type].objects++;
+        histogram[type].bytes += saved.size;
+
+        auto vtable = vtableBase + saved.vtable;
+        if (vtableOf(object) != vtable) {
+            memcpy((void *)object, &vtable, sizeof(vtable));
+        }
+    }
+
+#ifndef GC_COMPRESSED_REFS
+    // Mapped elsewhere: move the pointers (only the exact fields can be).
+    if (heapBase != (uint8_t *)header.base) {
+        Forwarding forwarding;
+        for (const auto &saved : objects) {
+            forwarding[(Traceable *)(header.base + saved.offset)] =
+                (Traceable *)(heapBase + saved.offset);
+        }
+        for (const auto &saved : objects) {
+            ((Traceable *)(heapBase + saved.offset))->updatePointers(forwarding);
         }
-        rsp++;
     }
+#endif
+
+    rebuildFreeSpace();
 
+    std::vector<Traceable *> result;
+    for (auto offset : roots) {
+        result.push_back((Traceable *)(heapBase + offset));
+    }
     return result;
 }
 
-void mark() {
-    auto worklist = getRoots();
+/**
+ * Idle-time collection: the host's event loop calls `gcIdle` when it
+ * expects to be idle until the `deadline`. It first helps with the
+ * background work of the last cycle (sweeping, moving the objects,
+ * marking), a slice at a time, and then starts the collections which
+ * would otherwise be triggered by allocations soon, if their last
+ * pause fits before the deadline: a scavenge of a half-full nursery,
+ * and a full cycle once the heap has grown by `kIdleGrowth` since the
+ * last one, or is close to the heap limit, or under memory pressure.
+ *
+ * Returns whether the collector has nothing left to do for now.
+ */
+static const double kIdleGrowth = 0.5;
+static const double kIdleLimitRatio = 0.75;
 
-    while (!worklist.empty()) {
-        auto o = worklist.back();
-        worklist.pop_back();
-        auto &header = o->getHeader();
+// Collections started by `gcIdle`.
+static size_t idleCollections = 0;
 
-        if (!header.marked) {
-            header.marked = true;
-            for (const auto &p : getPointers(o)) {
-                worklist.push_back(p);
+/**
+ * Does one slice of the background work, if there is any left.
+ */
+bool idleStep() {
+    Traceable *unmoved = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(heapMutex);
+        if (sweepNextPage()) {
+            return true;
+        }
+        if (marking) {
+            drainSatbQueue();
+            if (!markStack.empty()) {
+                for (size_t i = 0; i < kMarkSlice && !markStack.empty(); i++) {
+                    auto object = markStack.back();
+                    markStack.pop_back();
+                    markStep(object);
+                }
+                return true;
+            }
+        }
+        if (relocating) {
+            for (auto page : relocatedPages) {
+                auto objects = objectsInPage(page);
+                if (!objects.empty()) {
+                    unmoved = objects.front();
+                    break;
+                }
             }
         }
     }
-}
 
-void sweep() {
-    auto it = traceInfo.begin();
-    while (it != traceInfo.end()) {
-        if (it->second.marked) {
-            it->second.marked = false;
-            ++it;
-        } else {
-            delete it->first;
-            it = traceInfo.erase(it);
-        }
+    // Moving takes the lock itself:
+    if (unmoved != nullptr) {
+        relocateObject(unmoved);
+        return true;
     }
+    return false;
 }
 
-void gc() {
-    mark();
-    dump("After mark:");
-    sweep();
-    dump("After sweep:");
+bool nurseryHalfFull() {
+    return nurseryPage >= nurseryPages.size() / 2;
+}
+
+bool heapWorthCollecting() {
+    return heapSize > heapSizeAfterCollection * (1 + kIdleGrowth) + kRegionSize ||
+           heapSize > heapLimit * kIdleLimitRatio || underMemoryPressure();
+}
+
+bool gcIdle(std::chrono::steady_clock::time_point deadline) {
+    auto fits = [&](double milliseconds) {
+        return std::chrono::steady_clock::now() +
+                       std::chrono::duration<double, std::milli>(milliseconds) <
+               deadline;
+    };
+
+    while (true) {
+        while (fits(0) && idleStep()) {
+        }
+        if (!fits(0)) {
+            return false;
+        }
+
+        // What the background sweeping freed after the collection:
+        heapSizeAfterCollection = std::min<size_t>(heapSizeAfterCollection, heapSize);
+
+        if (generational && nurseryHalfFull()) {
+            auto average = scavengeCount == 0 ? 0 : scavengeMilliseconds / scavengeCount;
+            if (!fits(average)) {
+                return false;
+            }
+            scavenge();
+            continue;
+        }
+
+        if (heapWorthCollecting()) {
+            if (!fits(lastCollectionMilliseconds)) {
+                return false;
+            }
+            idleCollections++;
+            allocationsUntilPressureCheck = kPressureCheckInterval;
+            gc();
+            continue;
+        }
+        return true;
+    }
 }
 
 /*
@@ -216,7 +3829,154 @@ Node *createGraph() {
     return A; // Root
 }
 
+/**
+ * A deeply recursive worker: each frame holds a cell, and the deepest
+ * one collects a few times, rescanning only the top of the stack.
+ */
+__attribute__((noinline)) long recurse(long depth) {
+    auto cell = new Cell(depth);
+    if (depth == 0) {
+        for (int i = 0; i < 3; i++) {
+            gc();
+            print("Stack scanned: ", stackBytesScanned, " of ", stackCopy.size(), " bytes");
+        }
+        return 0;
+    }
+    return recurse(depth - 1) + cell->value;
+}
+
+/**
+ * A load spike: cells which are dropped right away.
+ */
+__attribute__((noinline)) void allocateSpike(long cells) {
+    Cell *list = nullptr;
+    for (long i = 0; i < cells; i++) {
+        list = new Cell(i, list);
+    }
+    print("Spike: ", readResidentBytes() / 1024, " KiB resident");
+}
+
+/**
+ * An event loop: each request allocates a list which it drops, and the
+ * loop is then idle for 200 ms, if it calls `gcIdle`. Collections which
+ * don't happen there are triggered by the allocations of the requests.
+ */
+__attribute__((noinline)) void serveRequests(bool idle) {
+    gcSetHeapLimit(heapSize + 2 * 1024 * 1024);
+    auto requestCollections = collections - idleCollections;
+    double slowest = 0;
+
+    for (int request = 0; request < 12; request++) {
+        auto start = std::chrono::steady_clock::now();
+        Cell *list = nullptr;
+        for (long i = 0; i < 10000; i++) {
+            list = new Cell(i, list);
+        }
+        auto elapsed = std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - start).count();
+        slowest = std::max(slowest, elapsed);
+
+        if (idle) {
+            auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(200);
+            gcIdle(deadline);
+            std::this_thread::sleep_until(deadline);
+        }
+    }
+
+    print(idle ? "With" : "Without", " gcIdle: ",
+          collections - idleCollections - requestCollections,
+          " collections in requests, slowest request ", slowest, " ms");
+    gcSetHeapLimit(SIZE_MAX);
+}
+
 int main(int argc, char const *argv[]) {
+#ifdef GC_COMPRESSED_REFS
+    print("Compressed references, sizeof(Node) = ", sizeof(Node));
+#else
+    print("Full references, sizeof(Node) = ", sizeof(Node));
+#endif
+
+    // Replays a recorded trace against the collector configurations:
+    // `--simulate <file>`.
+    if (argc == 3 && strcmp(argv[1], "--simulate") == 0) {
+        std::map<std::tuple<size_t, size_t, int>, SimulationResult> results;
+        for (auto collector : {SimulatedCollector::MarkSweep, SimulatedCollector::Copying}) {
+            for (size_t nurserySize : {0, 256 * 1024, 1024 * 1024}) {
+                for (size_t threshold = 64 * 1024; threshold <= 4 * 1024 * 1024; threshold *= 4) {
+                    auto result = simulateCollections(argv[2], {threshold, nurserySize, collector});
+                    results[{threshold, nurserySize, (int)collector}] = result;
+                    print(collector == SimulatedCollector::MarkSweep ? "Mark-sweep" : "Copying",
+                          ", nursery ", nurserySize, ", threshold ", threshold, ": ",
+                          result.collections, " collections, ", result.scavenges,
+                          " scavenges, peak heap ", result.peakHeapSize, ", copied ",
+                          result.copiedBytes);
+                }
+            }
+        }
+        auto at = [&](size_t threshold, size_t nurserySize, SimulatedCollector collector) {
+            return results.at({threshold, nurserySize, (int)collector});
+        };
+
+        // Rarer collections: fewer of them, and more garbage at the peak
+        // (though not at every step, since the peak falls between them).
+        auto distinct = at(64 * 1024, 0, SimulatedCollector::MarkSweep).peakHeapSize <
+                        at(4096 * 1024, 0, SimulatedCollector::MarkSweep).peakHeapSize;
+        for (size_t threshold = 256 * 1024; threshold <= 4 * 1024 * 1024; threshold *= 4) {
+            distinct = distinct && at(threshold, 0, SimulatedCollector::MarkSweep).collections <
+                                           at(threshold / 4, 0, SimulatedCollector::MarkSweep)
+                                                   .collections;
+        }
+        // A nursery takes the short-lived garbage off the full collections,
+        // and a copying collector copies what a mark-sweep leaves in place:
+        distinct = distinct &&
+                   at(64 * 1024, 1024 * 1024, SimulatedCollector::MarkSweep).collections <
+                           at(64 * 1024, 0, SimulatedCollector::MarkSweep).collections &&
+                   at(64 * 1024, 0, SimulatedCollector::MarkSweep).copiedBytes <
+                           at(64 * 1024, 0, SimulatedCollector::Copying).copiedBytes;
+        if (!distinct) {
+            print("The configurations aren't told apart by the simulation");
+            return 1;
+        }
+        return 0;
+    }
+
+    // Builds a graph and a long list, and saves them as a heap image:
+    // `--save-image <file>`; then starts from it: `--load-image <file>`.
+    if (argc == 3 && strcmp(argv[1], "--save-image") == 0) {
+        gcInit();
+        gcVerbose = false;
+        auto start = std::chrono::steady_clock::now();
+        auto A = createGraph();
+        Cell *list = nullptr;
+        for (long i = 0; i < 200000; i++) {
+            list = new Cell(i, list);
+        }
+        gcSaveImage(argv[2], {A, list});
+        print("Built and saved ", traceInfo.size(), " objects in ",
+              std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start)
+                  .count(),
+              " ms");
+        return 0;
+    }
+    if (argc == 3 && strcmp(argv[1], "--load-image") == 0) {
+        gcInit();
+        gcVerbose = false;
+        auto start = std::chrono::steady_clock::now();
+        auto roots = gcLoadImage(argv[2]);
+        print("Loaded ", traceInfo.size(), " objects in ",
+              std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start)
+                  .count(),
+              " ms");
+
+        auto A = (Node *)roots[0];
+        long sum = 0;
+        for (auto cell = (Cell *)roots[1]; cell != nullptr; cell = cell->next) {
+            sum += cell->value;
+        }
+        print("Root ", A->name, " -> ", A->left->name, ", ", A->right->name, "; list sum ", sum);
+        return 0;
+    }
+
     gcInit();
     auto A = createGraph();
     dump("Allocated graph:");
@@ -227,8 +3987,269 @@ int main(int argc, char const *argv[]) {
     // Run GC:
     gc();
 
-    // Manually destroy remaining stuff
-    delete A->left;
-    delete A;
+    // Nodes kept alive only by GC-managed containers:
+    auto index = new NodeIndex();
+    for (auto name : {'I', 'J', 'K', 'L', 'M'}) {
+        index->add(new Node(name));
+    }
+    index->byName.erase('K');
+    gc();
+    print("Index holds ", index->nodes.size(), " nodes, ",
+          index->byName.size(), " by name");
+
+    // Over the heap limit the soft caches are dropped before failing:
+    GcVector<gc_ptr<Node>> cache;
+    gcAddSoftCache([&cache]() {
+        print("Clearing the cache of ", cache.size(), " nodes");
+        cache.clear();
+    });
+    gcSetHeapLimit(heapSize + 1024);
+    for (auto name = 'a'; name <= 'z'; name++) {
+        try {
+            cache.push_back(new Node(name));
+        } catch (const std::bad_alloc &) {
+            print("Out of heap on Node ", name);
+        }
+    }
+    gcSetHeapLimit(SIZE_MAX);
+
+    // Fragmentation: every 8th cell of a long list survives, and the
+    // collection moves them out of the mostly empty pages:
+    gcVerbose = false;
+    Cell *list = nullptr;
+    for (long i = 0; i < 2000; i++) {
+        list = new Cell(i, list);
+    }
+    for (auto cell = list; cell != nullptr; cell = cell->next) {
+        for (int skip = 0; skip < 7 && cell->next != nullptr; skip++) {
+            cell->next = cell->next->next;
+        }
+    }
+    auto pagesBefore = pages.size() - freePages.size();
+    gc();
+    print("\nList of 2000 cells, 1/8 kept: ", pagesBefore, " pages before, ",
+          pages.size() - freePages.size(), " after collection");
+    long sum = 0;
+    for (auto cell = list; cell != nullptr; cell = cell->next) {
+        sum += cell->value;
+    }
+    print("Sum of the kept cells: ", sum);
+
+    // Concurrent sweeping: the collection returns after marking,
+    // and the list is built again while the old one is swept:
+    gcSetConcurrentSweeping(true);
+    list = nullptr;
+    gc();
+    for (long i = 0; i < 2000; i++) {
+        list = new Cell(i, list);
+    }
+    finishSweeping();
+    print("Heap after concurrent sweeping: ", traceInfo.size(), " objects, ",
+          pages.size() - freePages.size(), " pages");
+    gcSetConcurrentSweeping(false);
+
+    // Concurrent compaction: the kept cells are moved while the
+    // list is walked, the walk itself moving the ones it reaches first:
+    gcSetConcurrentCompaction(true);
+    for (auto cell = list; cell != nullptr; cell = cell->next) {
+        for (int skip = 0; skip < 7 && cell->next != nullptr; skip++) {
+            cell->next = cell->next->next;
+        }
+    }
+    gc();
+    sum = 0;
+    for (auto cell = list; cell != nullptr; cell = cell->next) {
+        sum += cell->value;
+    }
+    gc();
+    print("Sum of the kept cells after concurrent compaction: ", sum, ", ",
+          pages.size() - freePages.size(), " pages");
+    try {
+        gcSetRegions(true);
+    } catch (const std::logic_error &error) {
+        print(error.what());
+    }
+    gcSetConcurrentCompaction(false);
+    print("Objects still relocating: ", relocating ? "yes" : "no");
+
+    // Stack watermarks: the deep frames are not scanned again.
+    print("Sum of the recursion: ", recurse(1000));
+
+    // Generational mode: a quarter of the new cells survive, and are
+    // promoted by the parallel scavenges, with 1, 2 and 4 threads:
+    gcSetGenerational(true);
+    try {
+        gcSetConcurrentCompaction(true);
+    } catch (const std::logic_error &error) {
+        print(error.what());
+    }
+    GcVector<gc_ptr<Cell>> chains;
+    for (int i = 0; i < 64; i++) {
+        chains.push_back(nullptr);
+    }
+    for (size_t threads = 1; threads <= 4; threads *= 2) {
+        gcSetScavengeThreads(threads);
+        scavengeCount = 0;
+        scavengeMilliseconds = 0;
+        for (long i = 0; i < 100000; i++) {
+            auto cell = new Cell(i, chains[i % 64]);
+            if (i % 4 == 0) {
+                chains[i % 64] = cell;
+            }
+        }
+        print(threads, " scavenge threads: ", scavengeCount, " scavenges in ",
+              scavengeMilliseconds, " ms");
+    }
+    gcSetGenerational(false);
+    sum = 0;
+    for (auto chain : chains) {
+        for (auto cell = chain.get(); cell != nullptr; cell = cell->next) {
+            sum += cell->value;
+        }
+    }
+    print("Sum of the promoted cells: ", sum);
+
+    // Zero-copy I/O: the kernel copies straight between two buffers
+    // through a pipe. Only the data address of the pinned one is held
+    // while the collection runs, as by an asynchronous read.
+    int pipeFds[2];
+    if (pipe(pipeFds) == 0) {
+        const char message[] = "Hello from a GC buffer";
+        auto out = new (Slots{sizeof(message)}) GcBuffer(sizeof(message));
+        memcpy(out->data(), message, sizeof(message));
+        {
+            GcPin pin(out);
+            write(pipeFds[1], out->data(), out->size);
+        }
+
+        auto in = new (Slots{sizeof(message)}) GcBuffer(sizeof(message));
+        in->pin();
+        void *pending = in->data();
+        in = nullptr;
+        gc();
+        auto received = read(pipeFds[0], pending, sizeof(message));
+        in = GcBuffer::fromData(pending);
+        in->unpin();
+        print("Read ", received, " bytes: ", (const char *)in->data());
+        close(pipeFds[0]);
+        close(pipeFds[1]);
+    }
+
+    // Arena scope: the objects of a request are neither traced nor
+    // swept, and are freed at once when the scope closes:
+    GcVector<gc_ptr<Node>> outside;
+    gc_ptr<Node> last;
+    {
+        GcArenaScope request;
+        auto heapIndex = index;
+        auto objects = traceInfo.size();
+        auto index = new NodeIndex();
+        for (auto name : {'x', 'y', 'z'}) {
+            index->add(new Node(name));
+        }
+        index->add(A);
+        gc();
+        print("Arena index holds ", index->nodes.size(), " nodes, GC heap objects: ", objects,
+              " before, ", traceInfo.size(), " after");
+
+        // The references to and within the arena (compressed ones too):
+        std::string names;
+        for (auto &node : index->nodes) {
+            names += node->name;
+        }
+        print("Arena index nodes: ", names, ", by name: y -> ",
+              (*index->byName.find('y'))->name, ", A -> ", (*index->byName.find('A'))->name);
+        try {
+            A->right = index->nodes[0];
+        } catch (const std::logic_error &error) {
+            print(error.what());
+        }
+
+        // Containers outside the arena grow on the GC heap, so they
+        // can't take arena objects:
+        for (int i = 0; i < 4; i++) {
+            heapIndex->nodes.push_back(A);
+        }
+        outside.push_back(A);
+        try {
+            outside.push_back(index->nodes[0]);
+        } catch (const std::logic_error &error) {
+            print(error.what());
+        }
+
+        // A local variable outside the scope is reset when it closes:
+        last = index->nodes[1];
+
+        // An object whose constructor throws isn't destroyed again:
+        try {
+            new ChildNode('c', A);
+        } catch (const std::logic_error &error) {
+            print(error.what());
+        }
+    }
+    gc();
+    print("Heap index: ", index->nodes.size(), " nodes, store on the GC heap: ",
+          traceInfo.count(index->nodes.store.get()) != 0, "; outside vector: ", outside.size(),
+          " node, store on the GC heap: ", traceInfo.count(outside.store.get()) != 0,
+          "; last arena node: ", last == nullptr ? "reset" : "dangling");
+
+    // Class histogram: what a part of the program left on the heap.
+    auto before = gcHistogram();
+    auto names = new NodeIndex();
+    for (auto name = 'a'; name <= 'e'; name++) {
+        names->add(new Node(name));
+    }
+    gc();
+    printHistogram("Heap histogram:", gcHistogram());
+    printHistogram("Heap histogram changes:", diffHistograms(before, gcHistogram()));
+
+    // After the spike its pages stay free for a few collections,
+    // and are then returned to the OS:
+    allocateSpike(200000);
+    for (int i = 0; i < 4; i++) {
+        gc();
+        print("After collection: ", readResidentBytes() / 1024, " KiB resident, ",
+              decommittedPages, " pages returned");
+    }
+
+    // Collections in idle time instead of in the requests:
+    serveRequests(false);
+    serveRequests(true);
+    print("Idle collections: ", idleCollections);
+    gcVerbose = true;
+
+    // Region-based collection: each collection evacuates the regions
+    // with the most garbage which fit into the pause time goal, while
+    // the next marking runs in the background:
+    gcSetRegions(true);
+    gcSetPauseTimeGoal(2);
+    list = nullptr;
+    for (long i = 0; i < 20000; i++) {
+        list = new Cell(i, list);
+    }
+    for (auto cell = list; cell != nullptr; cell = cell->next) {
+        for (int skip = 0; skip < 7 && cell->next != nullptr; skip++) {
+            cell->next = cell->next->next;
+        }
+    }
+    for (int i = 0; i < 4; i++) {
+        // Requests allocate short-lived cells, and then wait for I/O,
+        // while the marking runs in the background:
+        for (long j = 0; j < 5000; j++) {
+            new Cell(j);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        gc();
+        print("Heap after region collection: ", pages.size() - freePages.size(), " pages");
+    }
+    sum = 0;
+    for (auto cell = list; cell != nullptr; cell = cell->next) {
+        sum += cell->value;
+    }
+    print("Sum of the kept cells: ", sum);
+    gcSetRegions(false);
+
+    // The remaining objects are the collector's: `delete` no longer
+    // frees them (see `Traceable::operator delete`).
     return 0;
 }